@@ -10,7 +10,9 @@
 
 	Compile with:
 
-		gcc --std=c11 blur.c
+		gcc --std=c11 -O2 -march=native blur.c -lm -lpthread
+
+	-march=native enables the AVX2 convolution where the CPU has it.
 
 	Known Bugs:
 
@@ -43,11 +45,24 @@
 */
 
 
+/*
+	For pthread_setaffinity_np, used to pin workers to CPUs.
+*/
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdatomic.h>
 #include <pthread.h>
 #include <unistd.h>
 #include <math.h>
+#include <time.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 #define STBI_NO_HDR
 #define STB_IMAGE_IMPLEMENTATION
@@ -69,8 +84,47 @@ struct cmd_args_t
 	int argc;
 
 	float kernel_size;
-	char *input_file;
-	char *output_file;
+	/*
+		Ring of the classic bokeh, or a flat disc.
+	*/
+	enum kernel_shape_t { KERNEL_RING, KERNEL_DISC, KERNEL_SHAPES } shape;
+	/*
+		Sets of input and output files, file_sets of them. A set is an
+		input and an output, with the depth image in between when
+		z-blurring.
+	*/
+	char **files;
+	int file_sets;
+	int set_size;
+	/*
+		Number of worker threads, 0 for one per CPU.
+	*/
+	unsigned int threads;
+	/*
+		Non-zero to pin worker i to CPU i.
+	*/
+	int pin;
+	/*
+		How many times each image is blurred.
+	*/
+	unsigned int passes;
+	/*
+		Direct or FFT convolution, or picked by kernel size. The 
+		separable convolution approximates the kernel with at most 
+		components separable ones, the fast one with a flat disc.
+	*/
+	enum { CONV_AUTO, CONV_DIRECT, CONV_FFT, CONV_SEPARABLE, CONV_FAST } convolution;
+	unsigned int components;
+	/*
+		How pixels outside the image are read.
+	*/
+	enum border_t { BORDER_MIRROR, BORDER_CLAMP, BORDER_WRAP, BORDER_CONSTANT } border;
+	/*
+		Non-zero to blur by depth, the kernel size is then the blur at
+		depths furthest from focus.
+	*/
+	int zblur;
+	float focus;
 } cmd_args;
 
 /*
@@ -100,6 +154,31 @@ unsigned int image_descr_pixel_index(
 	struct image_descr_t const *img,
 	unsigned int x,
 	unsigned int y);
+/*
+	Maps a coordinate into [0, n) the way the border mode says, -1 for
+	BORDER_CONSTANT outside the image.
+*/
+int   border_coordinate(
+	int v,
+	int n,
+	enum border_t);
+/*
+	The pixel at any x, y, following cmd_args.border outside the image.
+*/
+byte const *image_descr_pixel(
+	struct image_descr_t const *img,
+	int x,
+	int y);
+
+/*
+	A kernel value worth multiplying, at dx, dy from the output pixel.
+*/
+struct kernel_tap_t
+{
+	short dx;
+	short dy;
+	float weight;
+};
 
 struct filter_kernel_t
 {
@@ -117,11 +196,19 @@ struct filter_kernel_t
 		A flat array representing a kernel.
 	*/
 	float *values;
+	/*
+		The values of at least KERNEL_TAP_EPSILON times the largest, in
+		row order, tap_count of them. Most of the square around the ring
+		is zero or close to it.
+	*/
+	struct kernel_tap_t *taps;
+	unsigned int tap_count;
 };
 
 int   kernel_init(
 	struct filter_kernel_t *, 
-	float radius);
+	float radius,
+	enum kernel_shape_t);
 float kernel_sample(
 	struct filter_kernel_t const * const, 
 	byte x,
@@ -129,6 +216,238 @@ float kernel_sample(
 void  kernel_free(
 	struct filter_kernel_t *);
 
+#define KERNEL_TAP_EPSILON 1e-3f
+#define KERNEL_MAX_RADIUS 126
+
+/*
+	Kernels are made once per radius and shape and shared by everything
+	that needs them, the blur and the depth of field bank. Only whole
+	pixels of radius matter, 8 and 8.5 make the same kernel.
+
+	Returns NULL for radii kernel_init doesn't support or if out of 
+	memory. NOT THREAD SAFE, get kernels before the workers run.
+*/
+struct filter_kernel_t const *kernel_get(
+	float radius,
+	enum kernel_shape_t);
+void  kernel_cache_free(void);
+
+/*
+	Kernels at least this wide are convolved with FFTs when the 
+	convolution is picked automatically. Measured with the sparse taps 
+	on a 2048x1536 image and one thread, where the direct convolution 
+	took about as long as the FFT one at a width of 32 with AVX2 and 10
+	without.
+*/
+#ifdef __AVX2__
+#define FFT_MIN_KERNEL_WIDTH 32
+#else
+#define FFT_MIN_KERNEL_WIDTH 10
+#endif
+#define FFT_MAX_SIZE 4096
+
+/*
+	Convolution by FFT. Every task is a tile of output pixels, the input
+	around it, size x size pixels, is transformed, multiplied with the 
+	transformed kernel and transformed back. The outputs that didn't
+	wrap around are kept (overlap-save), so tiles are independent and 
+	can be done by any worker in any order.
+
+	The transform is an in place complex radix-2 FFT. The kernel is 
+	real, so two colour channels are convolved at once as the real and
+	imaginary part of one complex image.
+*/
+struct fft_t
+{
+	/*
+		Transform size, a power of two, 0 when convolving directly.
+	*/
+	unsigned int size;
+	/*
+		Output pixels per side of a tile, size - kernel width + 1.
+	*/
+	unsigned int tile;
+	/*
+		Bit reversal permutation, size entries, and the twiddle factors
+		cos and sin of 2 pi k / size, size / 2 pairs.
+	*/
+	unsigned int *reverse;
+	float *twiddles;
+	/*
+		Transform of the flipped kernel, scaled by 1 / size^2. size^2
+		complex values, real and imaginary parts interleaved.
+	*/
+	float *kernel;
+};
+
+int   fft_init(
+	struct fft_t *,
+	struct filter_kernel_t const *,
+	unsigned int w,
+	unsigned int h,
+	unsigned int min_tiles);
+void  fft_free(
+	struct fft_t *);
+
+/*
+	Separable approximation of the kernel. The kernel is symmetric, so 
+	its eigen decomposition is its singular value decomposition, with 
+	signs: kernel[j][i] = sum over c of value_c vector_c[j] vector_c[i].
+	The components with the largest magnitude values are kept, each is
+	convolved as a horizontal pass with its vector and a vertical pass
+	with its vector scaled by its value.
+
+	That's 2 x width multiplies per component per pixel rather than 
+	width x width.
+*/
+#define SEPARABLE_MAX_COMPONENTS 16
+
+struct separable_t
+{
+	/*
+		Number of components, 0 when not convolving separably.
+	*/
+	unsigned int count;
+	/*
+		count x kernel width values each, row c is component c.
+	*/
+	float *rows;
+	float *columns;
+};
+
+int   separable_init(
+	struct separable_t *,
+	struct filter_kernel_t const *,
+	unsigned int max_components);
+void  separable_free(
+	struct separable_t *);
+
+/*
+	The input of a pass as planar float channels, red, green and blue
+	planes, with a halo around the image filled as the border mode 
+	says. Every convolution reads these, so none of them has to check
+	bounds. The direct convolution reads the taps of neighbouring 
+	output pixels from neighbouring floats, so it runs 8 pixels at a
+	time without address math per tap.
+*/
+struct planes_t
+{
+	/*
+		Pixels of halo on every side, and floats per plane row, a 
+		multiple of 8 with at least 8 spare.
+	*/
+	unsigned int halo;
+	size_t stride;
+	/*
+		Rows per plane, image height plus twice the halo.
+	*/
+	size_t rows;
+	float *data;
+	size_t capacity;
+};
+
+int   planes_fill(
+	struct planes_t *,
+	struct image_descr_t const *,
+	unsigned int halo);
+/*
+	Channel c at x, y of the image, x and y may be up to halo outside.
+*/
+float const *planes_at(
+	struct planes_t const *,
+	int c,
+	int x,
+	int y);
+void  planes_free(
+	struct planes_t *);
+
+/*
+	Depth of field blur. Every pixel gets a circle of confusion, 
+	kernel size x |depth - focus|, rounded to whole pixels of radius.
+	The kernel of every radius up to the kernel size is taken from the
+	kernel cache.
+
+	The blur is a scatter written as a gather: every output pixel sums
+	the neighbours whose kernels reach it, weighted by those kernels,
+	and divides by the total weight. Neighbours in front of the focal 
+	plane, the near layer, spread by their own radius and bleed over 
+	whatever is behind them. Neighbours behind it, the far layer, 
+	spread by at most the radius of the pixel they land on, so a blurry
+	background doesn't bleed over a sharper pixel in front of it.
+
+	Depth images are grey, 0 is nearest, white is furthest.
+*/
+struct zblur_t
+{
+	/*
+		Cached kernels by radius, levels of them. Radius 0 and 1 are 
+		unblurred and have no kernel.
+	*/
+	struct filter_kernel_t const **bank;
+	unsigned int levels;
+	/*
+		Radius of every pixel, negative in the near layer, with the 
+		same halo as the float planes. NULL when not z-blurring.
+	*/
+	signed char *coc;
+	size_t stride;
+	unsigned int halo;
+	/*
+		Largest radius in the current image.
+	*/
+	unsigned int max_radius;
+};
+
+int   zblur_init(
+	struct zblur_t *,
+	float max_radius);
+int   zblur_depth(
+	struct zblur_t *,
+	char const *depth_file,
+	unsigned int w,
+	unsigned int h,
+	unsigned int halo);
+void  zblur_free(
+	struct zblur_t *);
+
+/*
+	Fast preview blur. The kernel is replaced by a flat disc made of
+	SAT_BANDS boxes, horizontal bands of rows as wide as the disc is
+	at their middle. Box sums come from summed area tables of the float
+	planes, four reads per box and channel, so the cost per pixel is 
+	the same for every radius, and every pixel may have its own.
+*/
+#define SAT_BANDS 8
+
+struct sat_t
+{
+	/*
+		Bands for every radius up to levels - 1, SAT_BANDS of them per
+		radius, first row, end row and half width relative to the pixel.
+		Unused bands are empty.
+	*/
+	short *bands;
+	unsigned int levels;
+	/*
+		Sums of the float planes above and left of every plane position,
+		one plane per channel, with a leading row and column of zeros.
+		NULL when not blurring fast.
+	*/
+	double *data;
+	size_t stride;
+	size_t rows;
+	size_t capacity;
+};
+
+int   sat_init(
+	struct sat_t *,
+	float max_radius);
+int   sat_build(
+	struct sat_t *,
+	struct planes_t const *);
+void  sat_free(
+	struct sat_t *);
+
 struct blur_task_t
 {
 	/* 
@@ -146,29 +465,218 @@ struct blur_task_t
 	/*
 		Width and height of block of pixels to process.
 	*/
-	byte w;
-	byte h;
+	unsigned short w;
+	unsigned short h;
 };
 
 struct context_t
 {
-	struct filter_kernel_t kernel;
+	struct filter_kernel_t const *kernel;
+	struct fft_t fft;
+	struct separable_t separable;
+	struct planes_t planes;
+	struct zblur_t zblur;
+	struct sat_t sat;
 	struct blur_task_t *tasks;
-	pthread_mutex_t task_mutex;
-	unsigned int current_task;
+	/*
+		Index of the next task to hand out. Workers claim tasks with
+		an atomic increment, so no lock is taken per task.
+	*/
+	atomic_uint current_task;
 	unsigned int task_count;
-} ctx = {{0, 0, NULL}, NULL, PTHREAD_MUTEX_INITIALIZER, 1, 0};
+} ctx = {NULL, {0, 0, NULL, NULL, NULL}, {0, NULL, NULL}, {0, 0, 0, NULL, 0}, {NULL, 0, NULL, 0, 0, 0}, {NULL, 0, NULL, 0, 0, 0}, NULL, 0, 0};
+
+/*
+	Per worker state and statistics.
+*/
+struct worker_t
+{
+	pthread_t thread;
+	unsigned int id;
+	struct pool_t *pool;
+	struct blur_task_t const *tasks;
+	/*
+		Filled in by the worker: tasks and pixels processed and the 
+		time spent on them, in seconds.
+	*/
+	unsigned int tasks_done;
+	unsigned long pixels_done;
+	double busy_time;
+	/*
+		FFT scratch space, a size x size complex image and a column,
+		for fft_size.
+	*/
+	float *fft_image;
+	float *fft_column;
+	unsigned int fft_size;
+	/*
+		Horizontal pass results of the separable convolution, 
+		separable_capacity floats.
+	*/
+	float *separable_rows;
+	size_t separable_capacity;
+};
+
+/*
+	A pool of worker threads, created once and kept alive for every
+	blur pass over every image. run() hands the current task list in
+	ctx to all workers and waits for them to finish it.
+*/
+struct pool_t
+{
+	struct worker_t *workers;
+	unsigned int count;
+	pthread_mutex_t mutex;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	/*
+		Bumped for every run, workers wait for it to change.
+	*/
+	unsigned long generation;
+	unsigned int running;
+	int quit;
+};
+
+int  pool_init(
+	struct pool_t *,
+	unsigned int threads,
+	int pin);
+void pool_run(
+	struct pool_t *);
+void pool_free(
+	struct pool_t *);
+
+/*
+	Picks the tile size of a pass. A tile reads its pixels plus kernel
+	width - 1 around them from the float planes, so tiles as wide as
+	the cache allows and as high as load balance allows read the least.
+	Within a tile:
+
+	- A direct output row reads kernel width plane rows, tile width +
+	  kernel width floats long, in 3 channels. The next row reuses all
+	  but one of them.
+	- Separable strips keep the horizontal sums of kernel width rows,
+	  components x 3 floats per pixel, in a ring.
+
+	Either is kept under half of L2, then tiles are made shorter until
+	every worker has TILES_PER_WORKER of them, but no shorter than the
+	kernel is wide. FFT tiles are set by the transform, the depth of
+	field and fast blurs keep 64 x 64.
+*/
+#define TILES_PER_WORKER 8
+#define TILE_MAX_WIDTH 1024
+
+void  tile_size(
+	unsigned int *tile_w,
+	unsigned int *tile_h,
+	unsigned int w,
+	unsigned int h,
+	unsigned int workers);
+size_t cache_size(void);
+
+int  blur_file(
+	struct pool_t *,
+	char const *input_file,
+	char const *depth_file,
+	char const *output_file);
 
 void *blur_worker(void *);
+int   blur_task_direct(
+	struct blur_task_t const *);
+int   blur_task_indexed(
+	struct blur_task_t const *);
+int   blur_task_fft(
+	struct worker_t *,
+	struct blur_task_t const *);
+int   blur_task_separable(
+	struct worker_t *,
+	struct blur_task_t const *);
+int   blur_task_zblur(
+	struct blur_task_t const *);
+int   blur_task_sat(
+	struct blur_task_t const *);
+double seconds_now(void);
 
 int main(int argc, char *argv[])
 {
 	cmd_args_init(argc, argv);
 
+	ctx.kernel = kernel_get(cmd_args.kernel_size, cmd_args.shape);
+	if (ctx.kernel == NULL)
+	{
+		LOG("ERR", "Could not init kernel.\n");
+		return 4;
+	}
+	LOGF("INFO", "Kernel %u pixels wide, %u of %u taps kept.\n", 
+		ctx.kernel->width, ctx.kernel->tap_count, ctx.kernel->width * ctx.kernel->width);
+
+	if (cmd_args.convolution == CONV_SEPARABLE 
+		&& !separable_init(&ctx.separable, ctx.kernel, cmd_args.components))
+	{
+		LOG("ERR", "Could not decompose kernel.\n");
+		kernel_cache_free();
+		return 4;
+	}
+	if (cmd_args.zblur && !zblur_init(&ctx.zblur, cmd_args.kernel_size))
+	{
+		LOG("ERR", "Could not init kernel bank.\n");
+		kernel_cache_free();
+		return 4;
+	}
+	if (cmd_args.convolution == CONV_FAST && !sat_init(&ctx.sat, cmd_args.kernel_size))
+	{
+		LOG("ERR", "Could not init disc bands.\n");
+		kernel_cache_free();
+		zblur_free(&ctx.zblur);
+		return 4;
+	}
+
+	struct pool_t pool;
+	if (!pool_init(&pool, cmd_args.threads, cmd_args.pin))
+	{
+		LOG("ERR", "Could not start workers.\n");
+		kernel_cache_free();
+		separable_free(&ctx.separable);
+		zblur_free(&ctx.zblur);
+		sat_free(&ctx.sat);
+		return 3;
+	}
+
+	int status = 0;
+	for (int i = 0; i < cmd_args.file_sets; ++i)
+	{
+		char **set = cmd_args.files + i * cmd_args.set_size;
+		int file_status = blur_file(&pool, set[0], cmd_args.zblur? set[1] : NULL, set[cmd_args.set_size - 1]);
+		status = file_status != 0? file_status : status;
+	}
+
+	LOG("TASK", "Stopping task workers.\n");
+	pool_free(&pool);
+	LOG("MEM", "Freeing kernels.\n");
+	kernel_cache_free();
+	fft_free(&ctx.fft);
+	separable_free(&ctx.separable);
+	planes_free(&ctx.planes);
+	zblur_free(&ctx.zblur);
+	sat_free(&ctx.sat);
+
+	puts("Good bye.");
+	return status;
+}
+
+/*
+	Blurs one image file cmd_args.passes times and writes the result.
+*/
+int blur_file(
+	struct pool_t *pool,
+	char const *input_file,
+	char const *depth_file,
+	char const *output_file)
+{
 	ctx.tasks = NULL;
 
 	int w, h, layers;
-	byte *pixels = stbi_load(cmd_args.input_file, &w, &h, &layers, 3);
+	byte *pixels = stbi_load(input_file, &w, &h, &layers, 3);
 	if (pixels == NULL)
 	{
 		LOG("ARG", "Image load error:");
@@ -178,11 +686,13 @@ int main(int argc, char *argv[])
 	if (w < 64 || h < 64)
 	{
 		LOG("ARG", "Sorry, image size must be at least 64x64.");
+		stbi_image_free(pixels);
 		return 2;
 	}
 	if (w > 16320 || h > 16320)
 	{
 		LOG("ARG", "Sorry, image size too large.");
+		stbi_image_free(pixels);
 		return 2;
 	}
 
@@ -193,12 +703,48 @@ int main(int argc, char *argv[])
 	if (outpixels == NULL)
 	{
 		LOG("MEM", "Sorry, couldn't allocate memory for result pixels.\n");
+		stbi_image_free(pixels);
+		return 3;
+	}
+
+	if (depth_file != NULL && !zblur_depth(&ctx.zblur, depth_file, w, h, ctx.kernel->width))
+	{
+		stbi_image_free(pixels);
+		free(outpixels);
+		return 1;
+	}
+
+	/*
+		Large kernels are convolved with FFTs, on tiles sized to suit
+		the transform. The depth of field blur has a kernel per pixel, 
+		so it always gathers directly.
+	*/
+	int const use_fft = !cmd_args.zblur && (cmd_args.convolution == CONV_FFT 
+		|| (cmd_args.convolution == CONV_AUTO && ctx.kernel->width >= FFT_MIN_KERNEL_WIDTH));
+	if (use_fft && !fft_init(&ctx.fft, ctx.kernel, w, h, pool->count))
+	{
+		LOG("MEM", "Couldn't set up the FFT, convolving directly.\n");
+	}
+	if (!use_fft)
+		fft_free(&ctx.fft);
+	if (ctx.fft.size)
+		LOGF("INFO", "FFT convolution, %u point transforms.\n", ctx.fft.size);
+
+	unsigned int tile_w, tile_h;
+	tile_size(&tile_w, &tile_h, w, h, pool->count);
+	if (!ctx.fft.size && !cmd_args.zblur && cmd_args.convolution != CONV_FAST)
+	{
+		unsigned int const span = ctx.kernel->width - 1;
+		LOGF("INFO", "%u x %u pixel tiles, about %.1f bytes of planes read per pixel.\n", tile_w, tile_h,
+			(double) (tile_w + span) * (tile_h + span) * 3 * sizeof(float) / ((double) tile_w * tile_h));
 	}
+	else
+		LOGF("INFO", "%u x %u pixel tiles.\n", tile_w, tile_h);
 
-	unsigned short tasks_x = w / 64;
-	unsigned short tasks_y = h / 64;
-	unsigned short last_task_x = w % 64;
-	unsigned short last_task_y = h % 64;
+	unsigned short tasks_x = w / tile_w;
+	unsigned short tasks_y = h / tile_h;
+	unsigned short last_task_x = w % tile_w;
+	unsigned short last_task_y = h % tile_h;
 
 	if (last_task_x != 0)
 		tasks_x += 1;
@@ -210,32 +756,35 @@ int main(int argc, char *argv[])
 	{
 		LOG("MEM", "Couldn't allocate memory. Good bye.");
 		stbi_image_free(pixels);
+		free(outpixels);
 		return 3;
 	}
 
 	LOGF("INFO", "%u tasks allocated!\n", tasks_x * tasks_y);
 	LOGF("MEM", "%u x %u x %u = %u bytes used by tasks\n", tasks_x, tasks_y, sizeof(struct blur_task_t), tasks_x * tasks_y * sizeof(struct blur_task_t));
 
-	struct image_descr_t in  = image_descr_rgb8(w, h, pixels);
-	struct image_descr_t out = image_descr_rgb8(w, h, outpixels);
+	struct image_descr_t images[2] = 
+	{ 
+		image_descr_rgb8(w, h, pixels),
+		image_descr_rgb8(w, h, outpixels)
+	};
 
 	/*
 		Create our task list by dividing up our image into buckets.
 		Each bucket is a task which will be processed by the worker
 		threads.
 	*/
-	unsigned int index = 0;
 	unsigned int start_y = 0;
 	for (int y = 0; y < tasks_y; y++)
 	{
 		unsigned int start_x = 0;
-		byte task_h = 64;
+		unsigned short task_h = tile_h;
 		if (y == tasks_y - 1 && last_task_y > 0)
 			task_h = last_task_y; 
 
 		for (int x = 0; x < tasks_x; x++)
 		{
-			byte task_w = 64;
+			unsigned short task_w = tile_w;
 			if (x == tasks_x - 1 && last_task_x > 0)
 				task_w = last_task_x;
 			unsigned int task_stride = (y * tasks_x) + x; 
@@ -243,136 +792,357 @@ int main(int argc, char *argv[])
 			ctx.tasks[task_stride].y = start_y;
 			ctx.tasks[task_stride].w = task_w;
 			ctx.tasks[task_stride].h = task_h;
-			ctx.tasks[task_stride].in  = &in;
-			ctx.tasks[task_stride].out = &out;
 			start_x += (x == tasks_x - 1 && last_task_x != 0)? last_task_x : task_w;
 		}
 		start_y += (y == tasks_y - 1 && last_task_y != 0)? last_task_y : task_h;
 	}
-
-	ctx.current_task = 0;
 	ctx.task_count = tasks_y * tasks_x;
 
-	if (!kernel_init(&ctx.kernel, cmd_args.kernel_size))
-	{
-		LOG("ERR", "Could not init kernel.\n");
-		return 4;
-	}
-
+	LOGF("ARG", "Processing %s -> %s, K-size: %f.\n", input_file, output_file, cmd_args.kernel_size);
 
-	LOG("TASK", "Launching task workers.\n");
-	pthread_t t1, t2, t3, t4;
 	/*
-		Set up worker threads.
+		Every pass reads the result of the one before, the two images
+		trade places in between.
 	*/
-	pthread_create(&t1, NULL, blur_worker, ctx.tasks);
-	pthread_create(&t2, NULL, blur_worker, ctx.tasks);
-	pthread_create(&t3, NULL, blur_worker, ctx.tasks);
-	pthread_create(&t4, NULL, blur_worker, ctx.tasks);
+	for (unsigned int pass = 0; pass < cmd_args.passes; ++pass)
+	{
+		struct image_descr_t *in  = &images[pass % 2];
+		struct image_descr_t *out = &images[(pass + 1) % 2];
+		for (unsigned int i = 0; i < ctx.task_count; ++i)
+		{
+			ctx.tasks[i].in  = in;
+			ctx.tasks[i].out = out;
+		}
+		atomic_store(&ctx.current_task, 0);
 
-	/* 
-		Wait for workers to end processing.
-	*/
-	pthread_join(t1, NULL);
-	pthread_join(t2, NULL);
-	pthread_join(t3, NULL);
-	pthread_join(t4, NULL);
+		LOGF("TASK", "Pass %u on %u workers.\n", pass + 1, pool->count);
+		double const start = seconds_now();
+		if (!planes_fill(&ctx.planes, in, ctx.kernel->width))
+		{
+			LOG("MEM", "Couldn't allocate float planes, convolving bytes.\n");
+		}
+		else if (ctx.sat.bands && !sat_build(&ctx.sat, &ctx.planes))
+		{
+			LOG("MEM", "Couldn't allocate summed area tables, blurring exactly.\n");
+		}
+		pool_run(pool);
+		double const elapsed = seconds_now() - start;
 
-	/*
-		Cleanup mutex, pixels and then tasks.
-		Probably best in that order.
-	*/
-	pthread_mutex_destroy(&ctx.task_mutex);
+		/*
+			Report how the work was spread, a worker that was busy much 
+			shorter than the rest points at load imbalance.
+		*/
+		double busiest = 0.0;
+		for (unsigned int i = 0; i < pool->count; ++i)
+		{
+			struct worker_t const *worker = &pool->workers[i];
+			LOGF("TIME", "Worker %u: %u tasks, %lu pixels, busy %.3f s.\n", 
+				worker->id, worker->tasks_done, worker->pixels_done, worker->busy_time);
+			busiest = worker->busy_time > busiest? worker->busy_time : busiest;
+		}
+		LOGF("TIME", "Blur took %.3f s, busiest worker %.3f s.\n", elapsed, busiest);
+	}
 
 	/*
 		Todo: Check errors.
 	*/
-	stbi_write_png(cmd_args.output_file, w, h, 3, outpixels, 0);
+	stbi_write_png(output_file, w, h, 3, images[cmd_args.passes % 2].data, 0);
 
 	LOG("MEM", "Freeing pixels.\n");
 	stbi_image_free(pixels);
 	free(outpixels);
 	LOG("MEM", "Freeing tasks.\n");
 	free(ctx.tasks);
-	LOG("MEM", "Freeing kernel.\n");
-	kernel_free(&ctx.kernel);
+	ctx.tasks = NULL;
 
-	puts("Good bye.");
+	return 0;
+}
+
+/*
+	Thread function of a pool worker. Runs the task list every time the
+	generation changes, until told to quit.
+*/
+void *pool_worker(void *arg_raw)
+{
+	struct worker_t *me = (struct worker_t *) arg_raw;
+	struct pool_t *pool = me->pool;
+	unsigned long seen = 0;
+
+	while (1)
+	{
+		pthread_mutex_lock(&pool->mutex);
+		while (pool->generation == seen && !pool->quit)
+			pthread_cond_wait(&pool->work, &pool->mutex);
+		if (pool->quit)
+		{
+			pthread_mutex_unlock(&pool->mutex);
+			return NULL;
+		}
+		seen = pool->generation;
+		pthread_mutex_unlock(&pool->mutex);
+
+		me->tasks = ctx.tasks;
+		me->tasks_done = 0;
+		me->pixels_done = 0;
+		me->busy_time = 0.0;
+		blur_worker(me);
+
+		pthread_mutex_lock(&pool->mutex);
+		pool->running -= 1;
+		if (pool->running == 0)
+			pthread_cond_signal(&pool->done);
+		pthread_mutex_unlock(&pool->mutex);
+	}
+}
+
+int  pool_init(
+	struct pool_t *pool,
+	unsigned int threads,
+	int pin)
+{
+	long const cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads == 0)
+		threads = cpus > 0? (unsigned int) cpus : 1;
+
+	pool->workers = calloc(threads, sizeof(struct worker_t));
+	if (pool->workers == NULL)
+		return 0;
+	pool->count = 0;
+	pool->generation = 0;
+	pool->running = 0;
+	pool->quit = 0;
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->done, NULL);
+
+	for (unsigned int i = 0; i < threads; ++i)
+	{
+		struct worker_t *worker = &pool->workers[i];
+		worker->id = i;
+		worker->pool = pool;
+		if (pthread_create(&worker->thread, NULL, pool_worker, worker) != 0)
+			break;
+		pool->count += 1;
+
+		if (pin && cpus > 0)
+		{
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(i % cpus, &set);
+			if (pthread_setaffinity_np(worker->thread, sizeof(set), &set) != 0)
+				LOGF("TASK", "Could not pin worker %u.\n", i);
+		}
+	}
+
+	if (pool->count == 0)
+	{
+		pool_free(pool);
+		return 0;
+	}
+	LOGF("TASK", "%u workers started.\n", pool->count);
+	return 1;
+}
+
+void pool_run(
+	struct pool_t *pool)
+{
+	pthread_mutex_lock(&pool->mutex);
+	pool->running = pool->count;
+	pool->generation += 1;
+	pthread_cond_broadcast(&pool->work);
+	while (pool->running > 0)
+		pthread_cond_wait(&pool->done, &pool->mutex);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+void pool_free(
+	struct pool_t *pool)
+{
+	pthread_mutex_lock(&pool->mutex);
+	pool->quit = 1;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (unsigned int i = 0; i < pool->count; ++i)
+	{
+		pthread_join(pool->workers[i].thread, NULL);
+		free(pool->workers[i].fft_image);
+		free(pool->workers[i].fft_column);
+		free(pool->workers[i].separable_rows);
+	}
+
+	pthread_cond_destroy(&pool->work);
+	pthread_cond_destroy(&pool->done);
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool->workers);
+	pool->workers = NULL;
+	pool->count = 0;
+}
+
+double seconds_now(void)
+{
+	struct timespec ts;
+	timespec_get(&ts, TIME_UTC);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
 }
 
 void *blur_worker(void *arg_raw)
 {
-	struct blur_task_t *task_list = (struct blur_task_t *) arg_raw;
-	struct blur_task_t task;
-	pthread_t me = pthread_self();
+	struct worker_t *me = (struct worker_t *) arg_raw;
 	/*
 		Worker loop.
 	*/
 	while (1)
 	{
 		/*
-			Acquire new task, which requires mutex acquisition.
+			Claim the next task. Tasks are never written while the 
+			workers run, so it can be used in place.
 		*/
-		pthread_mutex_lock(  &ctx.task_mutex);
-		if (ctx.current_task < ctx.task_count)
-		{
-			task = task_list[ctx.current_task];
-			ctx.current_task += 1;
-		}
-		else
+		unsigned int const index = atomic_fetch_add_explicit(&ctx.current_task, 1, memory_order_relaxed);
+		if (index >= ctx.task_count)
 		{
 			/*
 				No more tasks to process, so we can exit and die.
 			*/
-			pthread_mutex_unlock(&ctx.task_mutex);
-			return NULL;			
+			return NULL;
 		}
-		pthread_mutex_unlock(&ctx.task_mutex);
+		struct blur_task_t const task = me->tasks[index];
+		double const task_start = seconds_now();
 
 		/*
 			Do work on task.
 		*/
-		int pprocessed = 0;
-		for (int y = 0; y < task.h; ++y)
+		int pprocessed = ctx.sat.data && ctx.planes.data? blur_task_sat(&task)
+			: ctx.zblur.coc && ctx.planes.data? blur_task_zblur(&task)
+			: !ctx.planes.data? blur_task_indexed(&task)
+			: ctx.separable.count? blur_task_separable(me, &task)
+			: ctx.fft.size? blur_task_fft(me, &task) 
+			: blur_task_direct(&task);
+		if (pprocessed < 0)
 		{
-			for (int x = 0; x < task.w; ++x)
-			{				
-				float r = 0.0f, g = 0.0f, b = 0.0f;
-				for (int j = 0; j < ctx.kernel.width; ++j)
-				{
-					for (int i = 0; i < ctx.kernel.width; ++i)
-					{
-						unsigned int offset = 
-							image_descr_pixel_index(task.in, task.x + x - ctx.kernel.center + i, task.y + y - ctx.kernel.center + j);
-						byte const * const p = task.in->data + offset;
-
-						r += ((float) p[0]) * ctx.kernel.values[j * ctx.kernel.width + i];
-						g += ((float) p[1]) * ctx.kernel.values[j * ctx.kernel.width + i];
-						b += ((float) p[2]) * ctx.kernel.values[j * ctx.kernel.width + i];
-
-					}
-				}
-				unsigned int offset = 
-					image_descr_pixel_index(task.in, task.x + x, task.y + y);
-
-				*(task.out->data + offset    ) = ((byte) (r > 254.5? 255.0 : r));
-				*(task.out->data + offset + 1) = ((byte) (g > 254.5? 255.0 : g));
-				*(task.out->data + offset + 2) = ((byte) (b > 254.5? 255.0 : b));
-
-				pprocessed++;
-				// printf("%x%x%x  ", p[0], p[1], p[2]);
-			}
+			LOG("MEM", "Couldn't allocate scratch space, convolving directly.\n");
+			pprocessed = blur_task_indexed(&task);
 		}
-		// LOGF("WORK", "(%d): %d x %d @ (%u, %u).\n", me, task.w, task.h, task.x, task.y);
-		// LOGF("WORK", "(%d): %d pixels read.\n", me, pprocessed);
+		me->tasks_done += 1;
+		me->pixels_done += pprocessed;
+		me->busy_time += seconds_now() - task_start;
+		// LOGF("WORK", "(%d): %d x %d @ (%u, %u).\n", me->id, task.w, task.h, task.x, task.y);
+		// LOGF("WORK", "(%d): %d pixels read.\n", me->id, pprocessed);
 	}
 	return NULL;
 }
 
-int   kernel_init(
-	struct filter_kernel_t *k, 
-	float radius)
-{
+/*
+	Convolves a task directly from the float planes, returns the number
+	of pixels written. Works on up to 64 pixels of a row at a time, with
+	8 wide vectors when there's AVX2. Only the kernel's taps are read.
+*/
+int   blur_task_direct(
+	struct blur_task_t const *task)
+{
+	struct planes_t const *pl = &ctx.planes;
+	struct kernel_tap_t const *taps = ctx.kernel->taps;
+	unsigned int const tap_count = ctx.kernel->tap_count;
+	float sums[64];
+
+	for (unsigned int y = 0; y < task->h; ++y)
+	{
+		for (unsigned int x0 = 0; x0 < task->w; x0 += 64)
+		{
+			unsigned int const cw = task->w - x0 < 64? task->w - x0 : 64;
+			for (int c = 0; c < 3; ++c)
+			{
+				/*
+					The first output pixel, taps are relative to it.
+				*/
+				float const *origin = planes_at(pl, c, (int) (task->x + x0), (int) (task->y + y));
+#ifdef __AVX2__
+				/*
+					Rounded up to whole vectors, the planes have room 
+					for the extra reads.
+				*/
+				unsigned int const vectors = (cw + 7) / 8;
+				__m256 acc[8];
+				for (unsigned int v = 0; v < 8; ++v)
+					acc[v] = _mm256_setzero_ps();
+				for (unsigned int t = 0; t < tap_count; ++t)
+				{
+					float const *at = origin + taps[t].dy * (ptrdiff_t) pl->stride + taps[t].dx;
+					__m256 const weight = _mm256_set1_ps(taps[t].weight);
+					for (unsigned int v = 0; v < vectors; ++v)
+					{
+						__m256 const p = _mm256_loadu_ps(at + 8 * v);
+#ifdef __FMA__
+						acc[v] = _mm256_fmadd_ps(p, weight, acc[v]);
+#else
+						acc[v] = _mm256_add_ps(acc[v], _mm256_mul_ps(p, weight));
+#endif
+					}
+				}
+				for (unsigned int v = 0; v < vectors; ++v)
+					_mm256_storeu_ps(sums + 8 * v, acc[v]);
+#else
+				for (unsigned int x = 0; x < cw; ++x)
+				{
+					float sum = 0.0f;
+					for (unsigned int t = 0; t < tap_count; ++t)
+						sum += origin[taps[t].dy * (ptrdiff_t) pl->stride + taps[t].dx + x] * taps[t].weight;
+					sums[x] = sum;
+				}
+#endif
+				byte *out = task->out->data 
+					+ image_descr_pixel_index(task->out, task->x + x0, task->y + y) + c;
+				for (unsigned int x = 0; x < cw; ++x)
+					out[3 * x] = ((byte) (sums[x] > 254.5? 255.0 : sums[x]));
+			}
+		}
+	}
+	return task->w * task->h;
+}
+
+/*
+	Convolves a task directly from the bytes of the input image, for
+	when the float planes couldn't be allocated. Returns the number of 
+	pixels written.
+*/
+int   blur_task_indexed(
+	struct blur_task_t const *task)
+{
+	int pprocessed = 0;
+	for (int y = 0; y < task->h; ++y)
+	{
+		for (int x = 0; x < task->w; ++x)
+		{				
+			float r = 0.0f, g = 0.0f, b = 0.0f;
+			for (unsigned int t = 0; t < ctx.kernel->tap_count; ++t)
+			{
+				struct kernel_tap_t const *tap = &ctx.kernel->taps[t];
+				byte const * const p = image_descr_pixel(task->in, 
+					(int) (task->x + x) + tap->dx, (int) (task->y + y) + tap->dy);
+
+				r += ((float) p[0]) * tap->weight;
+				g += ((float) p[1]) * tap->weight;
+				b += ((float) p[2]) * tap->weight;
+			}
+			unsigned int offset = 
+				image_descr_pixel_index(task->in, task->x + x, task->y + y);
+
+			*(task->out->data + offset    ) = ((byte) (r > 254.5? 255.0 : r));
+			*(task->out->data + offset + 1) = ((byte) (g > 254.5? 255.0 : g));
+			*(task->out->data + offset + 2) = ((byte) (b > 254.5? 255.0 : b));
+
+			pprocessed++;
+			// printf("%x%x%x  ", p[0], p[1], p[2]);
+		}
+	}
+	return pprocessed;
+}
+
+int   kernel_init(
+	struct filter_kernel_t *k, 
+	float radius,
+	enum kernel_shape_t shape)
+{
 	if (radius < 1.0001f || radius > 126.9999f)
 	{
 		LOG("ARG", "A radius bigger than 127 or less than 1 is not supported.\n");
@@ -415,6 +1185,11 @@ int   kernel_init(
 			*/
 			float v = -fabs(evx * evx + evy * evy - 1.0f) + 1.0f;
 			v = v < 0.0f? 0.0f : v;
+			/*
+				The flat disc covers the ring and its inside.
+			*/
+			if (shape == KERNEL_DISC)
+				v = evx * evx + evy * evy < 2.0f? 1.0f : 0.0f;
 			/*
 				Kill negative values, or we'll get a difference kernel.
 			*/
@@ -437,9 +1212,81 @@ int   kernel_init(
 		k->center = 1;
 	}
 
+	/*
+		Keep the taps that matter.
+	*/
+	float largest = 0.0f;
+	for (int i = 0; i < (k->width * k->width); ++i)
+		largest = k->values[i] > largest? k->values[i] : largest;
+	k->taps = malloc(k->width * k->width * sizeof(struct kernel_tap_t));
+	if (k->taps == NULL)
+	{
+		LOG("MEM", "Could not allocate kernel taps.\n");
+		kernel_free(k);
+		return 0;
+	}
+	k->tap_count = 0;
+	for (int y = 0; y < k->width; ++y)
+	{
+		for (int x = 0; x < k->width; ++x)
+		{
+			float const v = k->values[y * k->width + x];
+			if (v < KERNEL_TAP_EPSILON * largest)
+				continue;
+			struct kernel_tap_t *tap = &k->taps[k->tap_count++];
+			tap->dx = (short) (x - k->center);
+			tap->dy = (short) (y - k->center);
+			tap->weight = v;
+		}
+	}
+
 	return 1;
 }
 
+static struct filter_kernel_t *kernel_cache[KERNEL_SHAPES][KERNEL_MAX_RADIUS + 1];
+
+struct filter_kernel_t const *kernel_get(
+	float radius,
+	enum kernel_shape_t shape)
+{
+	if (radius < 1.0001f || radius > KERNEL_MAX_RADIUS + 0.9999f)
+	{
+		LOG("ARG", "A radius bigger than 127 or less than 1 is not supported.\n");
+		return NULL;
+	}
+
+	/*
+		Built from the radius itself, kernel_init wants more than 1, but
+		filed under its whole pixels, which set the width.
+	*/
+	unsigned int const key = (unsigned int) radius;
+	if (kernel_cache[shape][key] == NULL)
+	{
+		struct filter_kernel_t *k = calloc(1, sizeof(struct filter_kernel_t));
+		if (k == NULL || !kernel_init(k, radius, shape))
+		{
+			free(k);
+			return NULL;
+		}
+		kernel_cache[shape][key] = k;
+	}
+	return kernel_cache[shape][key];
+}
+
+void  kernel_cache_free(void)
+{
+	for (int shape = 0; shape < KERNEL_SHAPES; ++shape)
+	{
+		for (int r = 0; r <= KERNEL_MAX_RADIUS; ++r)
+		{
+			if (kernel_cache[shape][r] != NULL)
+				kernel_free(kernel_cache[shape][r]);
+			free(kernel_cache[shape][r]);
+			kernel_cache[shape][r] = NULL;
+		}
+	}
+}
+
 float kernel_sample(
 	struct filter_kernel_t const * const k, 
 	byte x,
@@ -458,7 +1305,937 @@ void  kernel_free(
 	struct filter_kernel_t *k)
 {
 	free(k->values);
+	free(k->taps);
 	k->values = NULL;
+	k->taps = NULL;
+	k->tap_count = 0;
+}
+
+/*
+	In place FFT of size complex values, forward with e^(-2 pi i k / n) 
+	unless inverse is non-zero. Not normalised.
+*/
+void  fft_transform(
+	struct fft_t const *f,
+	float *x,
+	int inverse)
+{
+	unsigned int const n = f->size;
+	for (unsigned int i = 0; i < n; ++i)
+	{
+		unsigned int const j = f->reverse[i];
+		if (i < j)
+		{
+			float const re = x[2 * i], im = x[2 * i + 1];
+			x[2 * i] = x[2 * j];
+			x[2 * i + 1] = x[2 * j + 1];
+			x[2 * j] = re;
+			x[2 * j + 1] = im;
+		}
+	}
+
+	float const sign = inverse? 1.0f : -1.0f;
+	for (unsigned int len = 2; len <= n; len <<= 1)
+	{
+		unsigned int const half = len / 2;
+		unsigned int const step = n / len;
+		for (unsigned int i = 0; i < n; i += len)
+		{
+			float *a = x + 2 * i;
+			float *b = x + 2 * (i + half);
+			for (unsigned int k = 0; k < half; ++k)
+			{
+				float const wr = f->twiddles[2 * k * step];
+				float const wi = sign * f->twiddles[2 * k * step + 1];
+				float const tr = b[2 * k] * wr - b[2 * k + 1] * wi;
+				float const ti = b[2 * k] * wi + b[2 * k + 1] * wr;
+				b[2 * k]     = a[2 * k] - tr;
+				b[2 * k + 1] = a[2 * k + 1] - ti;
+				a[2 * k]     += tr;
+				a[2 * k + 1] += ti;
+			}
+		}
+	}
+}
+
+/*
+	2D FFT of a size x size complex image. Only the first rows rows are
+	transformed in the row pass: going forward the rest must be zero, 
+	going back the rest are left untransformed.
+*/
+void  fft_transform_2d(
+	struct fft_t const *f,
+	float *image,
+	float *column,
+	unsigned int rows,
+	int inverse)
+{
+	unsigned int const n = f->size;
+	if (!inverse)
+	{
+		for (unsigned int y = 0; y < rows; ++y)
+			fft_transform(f, image + 2 * (size_t) y * n, 0);
+	}
+
+	for (unsigned int x = 0; x < n; ++x)
+	{
+		for (unsigned int y = 0; y < n; ++y)
+		{
+			column[2 * y]     = image[2 * ((size_t) y * n + x)];
+			column[2 * y + 1] = image[2 * ((size_t) y * n + x) + 1];
+		}
+		fft_transform(f, column, inverse);
+		for (unsigned int y = 0; y < n; ++y)
+		{
+			image[2 * ((size_t) y * n + x)]     = column[2 * y];
+			image[2 * ((size_t) y * n + x) + 1] = column[2 * y + 1];
+		}
+	}
+
+	if (inverse)
+	{
+		for (unsigned int y = 0; y < rows; ++y)
+			fft_transform(f, image + 2 * (size_t) y * n, 1);
+	}
+}
+
+int   fft_init(
+	struct fft_t *f,
+	struct filter_kernel_t const *k,
+	unsigned int w,
+	unsigned int h,
+	unsigned int min_tiles)
+{
+	/*
+		Pick the transform size with the least work for the whole 
+		image: bigger transforms cost more per point but leave more of
+		every tile usable. There have to be enough tiles to keep 
+		min_tiles workers busy, unless the smallest size can't.
+	*/
+	unsigned int const kw = k->width;
+	unsigned int best = 0;
+	double best_cost = 0.0;
+	for (unsigned int n = 2; n <= FFT_MAX_SIZE; n *= 2)
+	{
+		if (n < kw + 1)
+			continue;
+		unsigned int const t = n - kw + 1;
+		double const tiles = (double) ((w + t - 1) / t) * ((h + t - 1) / t);
+		double const cost = tiles * n * n * log2(n);
+		if (best != 0 && tiles < min_tiles)
+			break;
+		if (best == 0 || cost < best_cost)
+		{
+			best = n;
+			best_cost = cost;
+		}
+	}
+	if (best == 0)
+		return 0;
+	if (best == f->size)
+		return 1;
+
+	fft_free(f);
+	unsigned int const n = best;
+	f->reverse  = malloc(n * sizeof(unsigned int));
+	f->twiddles = malloc(n * sizeof(float));
+	f->kernel   = calloc(2 * (size_t) n * n, sizeof(float));
+	float *column = malloc(2 * n * sizeof(float));
+	if (f->reverse == NULL || f->twiddles == NULL || f->kernel == NULL || column == NULL)
+	{
+		free(column);
+		fft_free(f);
+		return 0;
+	}
+	f->size = n;
+	f->tile = n - kw + 1;
+
+	unsigned int bits = 0;
+	while ((1u << bits) < n)
+		bits++;
+	for (unsigned int i = 0; i < n; ++i)
+	{
+		unsigned int r = 0;
+		for (unsigned int b = 0; b < bits; ++b)
+			r |= ((i >> b) & 1) << (bits - 1 - b);
+		f->reverse[i] = r;
+	}
+	for (unsigned int i = 0; i < n / 2; ++i)
+	{
+		double const a = 2.0 * M_PI * i / n;
+		f->twiddles[2 * i]     = (float) cos(a);
+		f->twiddles[2 * i + 1] = (float) sin(a);
+	}
+
+	/*
+		The blur is a correlation, out(x) = sum in(x + i) k(i), which is
+		a convolution with the kernel flipped around the origin.
+	*/
+	float const scale = 1.0f / ((float) n * n);
+	for (unsigned int j = 0; j < kw; ++j)
+	{
+		for (unsigned int i = 0; i < kw; ++i)
+		{
+			size_t const at = (size_t) ((n - j) % n) * n + (n - i) % n;
+			f->kernel[2 * at] = k->values[j * kw + i] * scale;
+		}
+	}
+	fft_transform_2d(f, f->kernel, column, n, 0);
+	free(column);
+	return 1;
+}
+
+void  fft_free(
+	struct fft_t *f)
+{
+	free(f->reverse);
+	free(f->twiddles);
+	free(f->kernel);
+	f->reverse = NULL;
+	f->twiddles = NULL;
+	f->kernel = NULL;
+	f->size = 0;
+	f->tile = 0;
+}
+
+/*
+	Convolves a task with FFTs, returns the number of pixels written or
+	-1 if the scratch space couldn't be allocated.
+*/
+int   blur_task_fft(
+	struct worker_t *me,
+	struct blur_task_t const *task)
+{
+	struct fft_t const *f = &ctx.fft;
+	unsigned int const n = f->size;
+	if (me->fft_size != n)
+	{
+		free(me->fft_image);
+		free(me->fft_column);
+		me->fft_image  = malloc(2 * (size_t) n * n * sizeof(float));
+		me->fft_column = malloc(2 * n * sizeof(float));
+		me->fft_size = n;
+		if (me->fft_image == NULL || me->fft_column == NULL)
+		{
+			free(me->fft_image);
+			free(me->fft_column);
+			me->fft_image = me->fft_column = NULL;
+			me->fft_size = 0;
+			return -1;
+		}
+	}
+
+	/*
+		Only this much of the input reaches the outputs of the task, the
+		rest of the transform is zero.
+	*/
+	unsigned int const in_w = task->w + ctx.kernel->width - 1;
+	unsigned int const in_h = task->h + ctx.kernel->width - 1;
+	float *image = me->fft_image;
+
+	/*
+		Red and green go together, then blue on its own.
+	*/
+	for (int pair = 0; pair < 2; ++pair)
+	{
+		memset(image, 0, 2 * (size_t) n * n * sizeof(float));
+		for (unsigned int y = 0; y < in_h; ++y)
+		{
+			float *row = image + 2 * (size_t) y * n;
+			int const sx = (int) task->x - ctx.kernel->center;
+			int const sy = (int) (task->y + y) - ctx.kernel->center;
+			float const *re = planes_at(&ctx.planes, pair == 0? 0 : 2, sx, sy);
+			float const *im = planes_at(&ctx.planes, 1, sx, sy);
+			for (unsigned int x = 0; x < in_w; ++x)
+			{
+				row[2 * x]     = re[x];
+				row[2 * x + 1] = pair == 0? im[x] : 0.0f;
+			}
+		}
+
+		fft_transform_2d(f, image, me->fft_column, in_h, 0);
+		for (size_t i = 0; i < (size_t) n * n; ++i)
+		{
+			float const re = image[2 * i], im = image[2 * i + 1];
+			float const kr = f->kernel[2 * i], ki = f->kernel[2 * i + 1];
+			image[2 * i]     = re * kr - im * ki;
+			image[2 * i + 1] = re * ki + im * kr;
+		}
+		fft_transform_2d(f, image, me->fft_column, task->h, 1);
+
+		for (unsigned int y = 0; y < task->h; ++y)
+		{
+			float const *row = image + 2 * (size_t) y * n;
+			for (unsigned int x = 0; x < task->w; ++x)
+			{
+				unsigned int offset = 
+					image_descr_pixel_index(task->in, task->x + x, task->y + y);
+				byte * const p = task->out->data + offset;
+				float const r = row[2 * x], g = row[2 * x + 1];
+				if (pair == 0)
+				{
+					p[0] = ((byte) (r > 254.5? 255.0 : r));
+					p[1] = ((byte) (g > 254.5? 255.0 : g));
+				}
+				else
+					p[2] = ((byte) (r > 254.5? 255.0 : r));
+			}
+		}
+	}
+
+	return task->w * task->h;
+}
+
+/*
+	Decomposes the kernel with the cyclic Jacobi eigenvalue method and 
+	keeps the max_components components with the largest eigenvalues.
+	Components below 1e-6 of the largest are dropped.
+*/
+int   separable_init(
+	struct separable_t *s,
+	struct filter_kernel_t const *k,
+	unsigned int max_components)
+{
+	unsigned int const n = k->width;
+	double *a = malloc((size_t) n * n * sizeof(double));
+	double *v = malloc((size_t) n * n * sizeof(double));
+	unsigned int *order = malloc(n * sizeof(unsigned int));
+	s->rows = malloc((size_t) max_components * n * sizeof(float));
+	s->columns = malloc((size_t) max_components * n * sizeof(float));
+	if (a == NULL || v == NULL || order == NULL || s->rows == NULL || s->columns == NULL)
+	{
+		free(a);
+		free(v);
+		free(order);
+		separable_free(s);
+		return 0;
+	}
+
+	double total = 0.0;
+	for (unsigned int i = 0; i < n * n; ++i)
+	{
+		a[i] = k->values[i];
+		v[i] = (i / n == i % n)? 1.0 : 0.0;
+		total += a[i] * a[i];
+	}
+
+	/*
+		Rotate the off diagonal entries away until they are negligible,
+		the columns of v collect the rotations, the eigenvectors.
+	*/
+	for (int sweep = 0; sweep < 50; ++sweep)
+	{
+		double off = 0.0;
+		for (unsigned int p = 0; p < n; ++p)
+			for (unsigned int q = p + 1; q < n; ++q)
+				off += a[p * n + q] * a[p * n + q];
+		if (off < 1e-24 * total)
+			break;
+
+		for (unsigned int p = 0; p < n; ++p)
+		{
+			for (unsigned int q = p + 1; q < n; ++q)
+			{
+				double const apq = a[p * n + q];
+				if (fabs(apq) < 1e-300)
+					continue;
+				double const theta = (a[q * n + q] - a[p * n + p]) / (2.0 * apq);
+				double const t = (theta >= 0.0? 1.0 : -1.0) / (fabs(theta) + sqrt(theta * theta + 1.0));
+				double const c = 1.0 / sqrt(t * t + 1.0);
+				double const sn = t * c;
+				for (unsigned int r = 0; r < n; ++r)
+				{
+					double const arp = a[r * n + p], arq = a[r * n + q];
+					a[r * n + p] = c * arp - sn * arq;
+					a[r * n + q] = sn * arp + c * arq;
+				}
+				for (unsigned int r = 0; r < n; ++r)
+				{
+					double const apr = a[p * n + r], aqr = a[q * n + r];
+					a[p * n + r] = c * apr - sn * aqr;
+					a[q * n + r] = sn * apr + c * aqr;
+				}
+				for (unsigned int r = 0; r < n; ++r)
+				{
+					double const vrp = v[r * n + p], vrq = v[r * n + q];
+					v[r * n + p] = c * vrp - sn * vrq;
+					v[r * n + q] = sn * vrp + c * vrq;
+				}
+			}
+		}
+	}
+
+	/*
+		Largest magnitudes first.
+	*/
+	for (unsigned int i = 0; i < n; ++i)
+		order[i] = i;
+	for (unsigned int i = 1; i < n; ++i)
+	{
+		unsigned int const o = order[i];
+		unsigned int j = i;
+		for (; j > 0 && fabs(a[order[j - 1] * (n + 1)]) < fabs(a[o * (n + 1)]); --j)
+			order[j] = order[j - 1];
+		order[j] = o;
+	}
+
+	s->count = 0;
+	double kept = 0.0;
+	double const largest = fabs(a[order[0] * (n + 1)]);
+	for (unsigned int c = 0; c < n && c < max_components; ++c)
+	{
+		double const value = a[order[c] * (n + 1)];
+		if (fabs(value) < 1e-6 * largest)
+			break;
+		for (unsigned int i = 0; i < n; ++i)
+		{
+			s->rows[c * n + i] = (float) v[i * n + order[c]];
+			s->columns[c * n + i] = (float) (value * v[i * n + order[c]]);
+		}
+		kept += value * value;
+		s->count += 1;
+	}
+	LOGF("INFO", "Kernel approximated by %u separable components, %.4f%% of its energy left out.\n", 
+		s->count, total > kept? 100.0 * (total - kept) / total : 0.0);
+
+	free(a);
+	free(v);
+	free(order);
+	return 1;
+}
+
+void  separable_free(
+	struct separable_t *s)
+{
+	free(s->rows);
+	free(s->columns);
+	s->rows = NULL;
+	s->columns = NULL;
+	s->count = 0;
+}
+
+/*
+	Convolves a task with the separable components, returns the number 
+	of pixels written or -1 if the scratch space couldn't be allocated.
+	The horizontal sums of the last kernel width input rows are kept in
+	a ring, every new row completes an output row.
+*/
+int   blur_task_separable(
+	struct worker_t *me,
+	struct blur_task_t const *task)
+{
+	struct separable_t const *s = &ctx.separable;
+	unsigned int const kw = ctx.kernel->width;
+	unsigned int const count = s->count;
+	unsigned int const in_h = task->h + kw - 1;
+	size_t const row_size = (size_t) task->w * count * 3;
+	size_t const needed = kw * row_size;
+	if (me->separable_capacity < needed)
+	{
+		free(me->separable_rows);
+		me->separable_rows = malloc(needed * sizeof(float));
+		me->separable_capacity = me->separable_rows == NULL? 0 : needed;
+		if (me->separable_rows == NULL)
+			return -1;
+	}
+
+	float *ring = me->separable_rows;
+	for (unsigned int row = 0; row < in_h; ++row)
+	{
+		/*
+			Horizontal passes of the input row, count x 3 values per
+			pixel, over the oldest row in the ring.
+		*/
+		float *h = ring + (row % kw) * row_size;
+		for (int ch = 0; ch < 3; ++ch)
+		{
+			float const *src = planes_at(&ctx.planes, ch, 
+				(int) task->x - ctx.kernel->center, (int) (task->y + row) - ctx.kernel->center);
+			for (unsigned int x = 0; x < task->w; ++x)
+			{
+				float *sums = h + (size_t) x * count * 3;
+				for (unsigned int c = 0; c < count; ++c)
+				{
+					float const *weights = s->rows + c * kw;
+					float sum = 0.0f;
+					for (unsigned int i = 0; i < kw; ++i)
+						sum += src[x + i] * weights[i];
+					sums[3 * c + ch] = sum;
+				}
+			}
+		}
+		if (row + 1 < kw)
+			continue;
+
+		/*
+			Vertical passes of the output row the ring now covers,
+			summing the components.
+		*/
+		unsigned int const y = row + 1 - kw;
+		for (unsigned int x = 0; x < task->w; ++x)
+		{
+			float r = 0.0f, g = 0.0f, b = 0.0f;
+			for (unsigned int j = 0; j < kw; ++j)
+			{
+				float const *sums = ring + ((y + j) % kw) * row_size + (size_t) x * count * 3;
+				for (unsigned int c = 0; c < count; ++c)
+				{
+					float const weight = s->columns[c * kw + j];
+					r += sums[3 * c] * weight;
+					g += sums[3 * c + 1] * weight;
+					b += sums[3 * c + 2] * weight;
+				}
+			}
+			r = r < 0.0f? 0.0f : r;
+			g = g < 0.0f? 0.0f : g;
+			b = b < 0.0f? 0.0f : b;
+
+			unsigned int offset = 
+				image_descr_pixel_index(task->in, task->x + x, task->y + y);
+			byte * const p = task->out->data + offset;
+			p[0] = ((byte) (r > 254.5? 255.0 : r));
+			p[1] = ((byte) (g > 254.5? 255.0 : g));
+			p[2] = ((byte) (b > 254.5? 255.0 : b));
+		}
+	}
+
+	return task->w * task->h;
+}
+
+void  tile_size(
+	unsigned int *tile_w,
+	unsigned int *tile_h,
+	unsigned int w,
+	unsigned int h,
+	unsigned int workers)
+{
+	if (ctx.fft.size)
+	{
+		*tile_w = *tile_h = ctx.fft.tile;
+		return;
+	}
+	if (cmd_args.zblur || cmd_args.convolution == CONV_FAST)
+	{
+		*tile_w = *tile_h = 64;
+		return;
+	}
+
+	size_t const budget = cache_size() / 2;
+	size_t const kw = ctx.kernel->width;
+	size_t fixed, per_pixel;
+	if (ctx.separable.count)
+	{
+		fixed = 0;
+		per_pixel = kw * ctx.separable.count * 3 * sizeof(float);
+	}
+	else
+	{
+		fixed = (kw + 1) * kw * 3 * sizeof(float);
+		per_pixel = (kw + 1) * 3 * sizeof(float);
+	}
+	size_t width = budget > fixed? (budget - fixed) / per_pixel : 0;
+	width = width > TILE_MAX_WIDTH? TILE_MAX_WIDTH : width;
+	width = width / 8 * 8;
+	width = width < 8? 8 : width;
+	width = width > w? w : width;
+
+	unsigned int const strips = (w + width - 1) / width;
+	unsigned int const wanted = TILES_PER_WORKER * (workers > 0? workers : 1);
+	unsigned int const bands = (wanted + strips - 1) / strips;
+	unsigned int height = (h + bands - 1) / bands;
+	height = height < kw? (unsigned int) kw : height;
+	height = height < 16? 16 : height;
+
+	*tile_w = (unsigned int) width;
+	*tile_h = height > h? h : height;
+}
+
+/*
+	Size of the L2 cache, 256 kB where it can't be asked.
+*/
+size_t cache_size(void)
+{
+#ifdef _SC_LEVEL2_CACHE_SIZE
+	long const size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+	if (size > 0)
+		return (size_t) size;
+#endif
+	return 256 * 1024;
+}
+
+int   zblur_init(
+	struct zblur_t *z,
+	float max_radius)
+{
+	z->levels = (unsigned int) max_radius + 1;
+	z->bank = calloc(z->levels, sizeof(struct filter_kernel_t const *));
+	if (z->bank == NULL)
+		return 0;
+	for (unsigned int r = 2; r < z->levels; ++r)
+	{
+		z->bank[r] = kernel_get((float) r, cmd_args.shape);
+		if (z->bank[r] == NULL)
+		{
+			zblur_free(z);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+	Reads the depth image and works out the radius of every pixel, 
+	with a halo like the float planes.
+*/
+int   zblur_depth(
+	struct zblur_t *z,
+	char const *depth_file,
+	unsigned int w,
+	unsigned int h,
+	unsigned int halo)
+{
+	int dw, dh, layers;
+	byte *depth = stbi_load(depth_file, &dw, &dh, &layers, 1);
+	if (depth == NULL)
+	{
+		LOG("ARG", "Depth image load error:");
+		puts(stbi_failure_reason());
+		return 0;
+	}
+	if ((unsigned int) dw != w || (unsigned int) dh != h)
+	{
+		LOG("ARG", "The depth image must be as large as the image.\n");
+		stbi_image_free(depth);
+		return 0;
+	}
+
+	free(z->coc);
+	z->halo = halo;
+	z->stride = w + 2 * halo;
+	z->coc = malloc(z->stride * (h + 2 * halo));
+	if (z->coc == NULL)
+	{
+		LOG("MEM", "Couldn't allocate depth radii.\n");
+		stbi_image_free(depth);
+		return 0;
+	}
+
+	z->max_radius = 0;
+	float const largest = (float) (z->levels - 1);
+	for (size_t y = 0; y < h + 2 * halo; ++y)
+	{
+		int const dy = border_coordinate((int) y - (int) halo, (int) h, cmd_args.border);
+		for (size_t x = 0; x < z->stride; ++x)
+		{
+			int const dx = border_coordinate((int) x - (int) halo, (int) w, cmd_args.border);
+			signed char radius = 0;
+			if (dx >= 0 && dy >= 0)
+			{
+				float const d = depth[dy * w + dx] / 255.0f - cmd_args.focus;
+				float r = cmd_args.kernel_size * fabsf(d) + 0.5f;
+				r = r > largest? largest : r;
+				radius = (signed char) (d < 0.0f? -(int) r : (int) r);
+				if ((unsigned int) r > z->max_radius)
+					z->max_radius = (unsigned int) r;
+			}
+			z->coc[y * z->stride + x] = radius;
+		}
+	}
+	LOGF("INFO", "Depth of field radii up to %u pixels.\n", z->max_radius);
+	if (z->max_radius < 2)
+		LOG("INFO", "Everything is in focus, the image is copied unblurred.\n");
+
+	stbi_image_free(depth);
+	return 1;
+}
+
+void  zblur_free(
+	struct zblur_t *z)
+{
+	free(z->bank);
+	free(z->coc);
+	z->bank = NULL;
+	z->coc = NULL;
+	z->levels = 0;
+}
+
+/*
+	Depth of field blur of a task, returns the number of pixels written.
+*/
+int   blur_task_zblur(
+	struct blur_task_t const *task)
+{
+	struct zblur_t const *z = &ctx.zblur;
+	struct planes_t const *pl = &ctx.planes;
+	int const reach = (int) z->max_radius;
+
+	for (unsigned int y = 0; y < task->h; ++y)
+	{
+		for (unsigned int x = 0; x < task->w; ++x)
+		{
+			int const px = (int) (task->x + x);
+			int const py = (int) (task->y + y);
+			int const own = abs(z->coc[(size_t) (py + z->halo) * z->stride + px + z->halo]);
+			float r = 0.0f, g = 0.0f, b = 0.0f, total = 0.0f;
+
+			/*
+				Neighbours at offset dx, dy, read with the weights the
+				plain blur would give them. Kernels reach reach pixels up
+				and left and reach - 1 down and right, the extra row and
+				column keep the centre in when nothing is blurred.
+			*/
+			for (int dy = -reach; dy <= reach; ++dy)
+			{
+				signed char const *coc = z->coc + (size_t) (py + dy + z->halo) * z->stride + z->halo;
+				float const *rrow = planes_at(pl, 0, 0, py + dy);
+				float const *grow = planes_at(pl, 1, 0, py + dy);
+				float const *brow = planes_at(pl, 2, 0, py + dy);
+				for (int dx = -reach; dx <= reach; ++dx)
+				{
+					int const q = coc[px + dx];
+					int radius = q < 0? -q : q;
+					if (q > 0 && own < radius)
+						radius = own;
+
+					float weight;
+					if (radius < 2)
+						weight = dx == 0 && dy == 0? 1.0f : 0.0f;
+					else
+					{
+						struct filter_kernel_t const *k = z->bank[radius];
+						int const i = dx + k->center;
+						int const j = dy + k->center;
+						if (i < 0 || j < 0 || i >= k->width || j >= k->width)
+							continue;
+						weight = k->values[j * k->width + i];
+					}
+					r += rrow[px + dx] * weight;
+					g += grow[px + dx] * weight;
+					b += brow[px + dx] * weight;
+					total += weight;
+				}
+			}
+
+			if (total > 0.0f)
+			{
+				r /= total;
+				g /= total;
+				b /= total;
+			}
+			unsigned int offset = 
+				image_descr_pixel_index(task->in, task->x + x, task->y + y);
+			byte * const p = task->out->data + offset;
+			p[0] = ((byte) (r > 254.5? 255.0 : r));
+			p[1] = ((byte) (g > 254.5? 255.0 : g));
+			p[2] = ((byte) (b > 254.5? 255.0 : b));
+		}
+	}
+	return task->w * task->h;
+}
+
+int   sat_init(
+	struct sat_t *t,
+	float max_radius)
+{
+	t->levels = (unsigned int) max_radius + 1;
+	t->bands = calloc((size_t) t->levels * SAT_BANDS * 3, sizeof(short));
+	if (t->bands == NULL)
+		return 0;
+
+	/*
+		Rows -r to r - 1 and columns -n to n - 1 around a pixel, like
+		the taps of the kernel of radius r, centred half a pixel up and
+		left of it.
+	*/
+	for (int r = 1; r < (int) t->levels; ++r)
+	{
+		int const count = 2 * r < SAT_BANDS? 2 * r : SAT_BANDS;
+		for (int b = 0; b < count; ++b)
+		{
+			short *band = t->bands + ((size_t) r * SAT_BANDS + b) * 3;
+			int const y0 = -r + (2 * r * b) / count;
+			int const y1 = -r + (2 * r * (b + 1)) / count;
+			double const d = (y0 + y1) / 2.0;
+			double const half = sqrt(r * r - d * d > 0.0? r * r - d * d : 0.0);
+			int const n = (int) (half + 0.5);
+			band[0] = (short) y0;
+			band[1] = (short) y1;
+			band[2] = (short) (n < 1? 1 : n);
+		}
+	}
+	return 1;
+}
+
+int   sat_build(
+	struct sat_t *t,
+	struct planes_t const *pl)
+{
+	size_t const stride = pl->stride + 1;
+	size_t const rows = pl->rows + 1;
+	if (stride * rows * 3 > t->capacity)
+	{
+		free(t->data);
+		t->data = malloc(stride * rows * 3 * sizeof(double));
+		t->capacity = t->data == NULL? 0 : stride * rows * 3;
+		if (t->data == NULL)
+			return 0;
+	}
+	t->stride = stride;
+	t->rows = rows;
+
+	for (int c = 0; c < 3; ++c)
+	{
+		double *sums = t->data + stride * rows * c;
+		float const *plane = pl->data + pl->rows * pl->stride * c;
+		for (size_t x = 0; x < stride; ++x)
+			sums[x] = 0.0;
+		for (size_t y = 1; y < rows; ++y)
+		{
+			float const *src = plane + (y - 1) * pl->stride;
+			double *above = sums + (y - 1) * stride;
+			double *row = sums + y * stride;
+			double run = 0.0;
+			row[0] = 0.0;
+			for (size_t x = 1; x < stride; ++x)
+			{
+				run += src[x - 1];
+				row[x] = above[x] + run;
+			}
+		}
+	}
+	return 1;
+}
+
+void  sat_free(
+	struct sat_t *t)
+{
+	free(t->bands);
+	free(t->data);
+	t->bands = NULL;
+	t->data = NULL;
+	t->capacity = 0;
+	t->levels = 0;
+}
+
+/*
+	Fast blur of a task, by the depth radii when z-blurring. Returns the
+	number of pixels written.
+*/
+int   blur_task_sat(
+	struct blur_task_t const *task)
+{
+	struct sat_t const *t = &ctx.sat;
+	unsigned int const halo = ctx.planes.halo;
+	int const radius = (int) t->levels - 1;
+
+	for (unsigned int y = 0; y < task->h; ++y)
+	{
+		/*
+			Table row and column of the pixel, tables start one before 
+			the halo.
+		*/
+		size_t const sy = task->y + y + halo;
+		for (unsigned int x = 0; x < task->w; ++x)
+		{
+			size_t const sx = task->x + x + halo;
+			int r = radius;
+			if (ctx.zblur.coc)
+				r = abs(ctx.zblur.coc[sy * ctx.zblur.stride + sx]);
+
+			unsigned int offset = 
+				image_descr_pixel_index(task->in, task->x + x, task->y + y);
+			byte * const p = task->out->data + offset;
+			if (r < 2)
+			{
+				for (int c = 0; c < 3; ++c)
+					p[c] = task->in->data[offset + c];
+				continue;
+			}
+
+			short const *bands = t->bands + (size_t) r * SAT_BANDS * 3;
+			double sums[3] = {0.0, 0.0, 0.0};
+			double area = 0.0;
+			for (int b = 0; b < SAT_BANDS; ++b)
+			{
+				short const *band = bands + 3 * b;
+				if (band[0] == band[1])
+					continue;
+				size_t const top    = (sy + band[0]) * t->stride;
+				size_t const bottom = (sy + band[1]) * t->stride;
+				size_t const left   = sx - band[2];
+				size_t const right  = sx + band[2];
+				for (int c = 0; c < 3; ++c)
+				{
+					double const *s = t->data + t->stride * t->rows * c;
+					sums[c] += s[bottom + right] - s[bottom + left] - s[top + right] + s[top + left];
+				}
+				area += (double) (band[1] - band[0]) * 2 * band[2];
+			}
+			for (int c = 0; c < 3; ++c)
+			{
+				double const v = sums[c] / area;
+				p[c] = ((byte) (v > 254.5? 255.0 : v));
+			}
+		}
+	}
+	return task->w * task->h;
+}
+
+int   planes_fill(
+	struct planes_t *pl,
+	struct image_descr_t const *img,
+	unsigned int halo)
+{
+	size_t const stride = ((img->w + 2 * halo + 8 + 7) / 8) * 8;
+	size_t const rows = img->h + 2 * halo;
+	if (stride * rows * 3 > pl->capacity)
+	{
+		free(pl->data);
+		pl->data = malloc(stride * rows * 3 * sizeof(float));
+		pl->capacity = pl->data == NULL? 0 : stride * rows * 3;
+		if (pl->data == NULL)
+			return 0;
+	}
+	pl->halo = halo;
+	pl->stride = stride;
+	pl->rows = rows;
+
+	/*
+		Border pixels are looked up once here, the convolutions read 
+		them like any other.
+	*/
+	for (size_t y = 0; y < rows; ++y)
+	{
+		float *r = pl->data + y * stride;
+		float *g = r + rows * stride;
+		float *b = g + rows * stride;
+		for (size_t x = 0; x < stride; ++x)
+		{
+			byte const *p = image_descr_pixel(img, (int) x - (int) halo, (int) y - (int) halo);
+			r[x] = p[0];
+			g[x] = p[1];
+			b[x] = p[2];
+		}
+	}
+	return 1;
+}
+
+float const *planes_at(
+	struct planes_t const *pl,
+	int c,
+	int x,
+	int y)
+{
+	return pl->data + pl->rows * pl->stride * c
+		+ (ptrdiff_t) (y + (int) pl->halo) * pl->stride + x + (int) pl->halo;
+}
+
+void  planes_free(
+	struct planes_t *pl)
+{
+	free(pl->data);
+	pl->data = NULL;
+	pl->capacity = 0;
 }
 
 struct image_descr_t image_descr_rgb8(
@@ -484,23 +2261,161 @@ unsigned int image_descr_pixel_index(
 	unsigned int y)
 {
 	/*
-		FIXME: Handle overflows.
+		Only for pixels inside the image, image_descr_pixel handles the 
+		borders.
 	*/
-	unsigned int ax = (x < 0 || x > img->w - 1? (img->w - x) % img->w : x);
-	unsigned int ay = (y < 0 || y > img->h - 1? (img->h - y) % img->h : y);
+	assert(x < img->w && y < img->h);
+	return img->row_stride   * y
+	     + img->pixel_stride * x;
+}
+
+int   border_coordinate(
+	int v,
+	int n,
+	enum border_t border)
+{
+	if (v >= 0 && v < n)
+		return v;
+
+	switch (border)
+	{
+	case BORDER_CLAMP:
+		return v < 0? 0 : n - 1;
+	case BORDER_WRAP:
+		v %= n;
+		return v < 0? v + n : v;
+	case BORDER_CONSTANT:
+		return -1;
+	case BORDER_MIRROR:
+	default:
+		/*
+			Reflected about the edge pixels, which aren't repeated, so 
+			the pattern repeats every 2n - 2 pixels.
+		*/
+		if (n == 1)
+			return 0;
+		v %= 2 * n - 2;
+		v = v < 0? v + 2 * n - 2 : v;
+		return v < n? v : 2 * n - 2 - v;
+	}
+}
 
-	return img->row_stride   * (ay)
-	     + img->pixel_stride * (ax);
+byte const *image_descr_pixel(
+	struct image_descr_t const *img,
+	int x,
+	int y)
+{
+	static byte const constant[3] = {0, 0, 0};
+	int const ax = border_coordinate(x, (int) img->w, cmd_args.border);
+	int const ay = border_coordinate(y, (int) img->h, cmd_args.border);
+	if (ax < 0 || ay < 0)
+		return constant;
+	return img->data + image_descr_pixel_index(img, (unsigned int) ax, (unsigned int) ay);
 }
 
 void cmd_args_init(int argc, char **argv)
 {
+	cmd_args.args = argv;
+	cmd_args.argc = argc;
+	cmd_args.threads = 0;
+	cmd_args.pin = 0;
+	cmd_args.passes = 1;
+	cmd_args.convolution = CONV_AUTO;
+	cmd_args.border = BORDER_MIRROR;
+	cmd_args.shape = KERNEL_RING;
+	cmd_args.zblur = 0;
+	cmd_args.focus = 0.0f;
+
+	/*
+		Options come first.
+	*/
+	int arg = 1;
+	for (; arg < argc && argv[arg][0] == '-' && argv[arg][1] != 0 && !isdigit((unsigned char) argv[arg][1]); ++arg)
+	{
+		if (strcmp(argv[arg], "-pin") == 0)
+			cmd_args.pin = 1;
+		else if (strcmp(argv[arg], "-t") == 0 && arg + 1 < argc)
+			cmd_args.threads = (unsigned int) atoi(argv[++arg]);
+		else if (strcmp(argv[arg], "-passes") == 0 && arg + 1 < argc)
+			cmd_args.passes = (unsigned int) atoi(argv[++arg]);
+		else if (strcmp(argv[arg], "-fft") == 0)
+			cmd_args.convolution = CONV_FFT;
+		else if (strcmp(argv[arg], "-direct") == 0)
+			cmd_args.convolution = CONV_DIRECT;
+		else if (strcmp(argv[arg], "-fast") == 0)
+			cmd_args.convolution = CONV_FAST;
+		else if (strcmp(argv[arg], "-border") == 0 && arg + 1 < argc)
+		{
+			char const *mode = argv[++arg];
+			if (strcmp(mode, "mirror") == 0)
+				cmd_args.border = BORDER_MIRROR;
+			else if (strcmp(mode, "clamp") == 0)
+				cmd_args.border = BORDER_CLAMP;
+			else if (strcmp(mode, "wrap") == 0)
+				cmd_args.border = BORDER_WRAP;
+			else if (strcmp(mode, "constant") == 0)
+				cmd_args.border = BORDER_CONSTANT;
+			else
+			{
+				LOGF("ARG", "Unknown border mode %s.\n", mode);
+				goto die;
+			}
+		}
+		else if (strcmp(argv[arg], "-shape") == 0 && arg + 1 < argc)
+		{
+			char const *shape = argv[++arg];
+			if (strcmp(shape, "ring") == 0)
+				cmd_args.shape = KERNEL_RING;
+			else if (strcmp(shape, "disc") == 0)
+				cmd_args.shape = KERNEL_DISC;
+			else
+			{
+				LOGF("ARG", "Unknown kernel shape %s.\n", shape);
+				goto die;
+			}
+		}
+		else if (strcmp(argv[arg], "-zblur") == 0 && arg + 1 < argc)
+		{
+			cmd_args.zblur = 1;
+			cmd_args.focus = (float) atof(argv[++arg]);
+		}
+		else if (strcmp(argv[arg], "-separable") == 0 && arg + 1 < argc)
+		{
+			cmd_args.convolution = CONV_SEPARABLE;
+			cmd_args.components = (unsigned int) atoi(argv[++arg]);
+		}
+		else
+		{
+			LOGF("ARG", "Unknown option %s.\n", argv[arg]);
+			goto die;
+		}
+	}
+	argv += arg - 1;
+	argc -= arg - 1;
+
 	if (argc < 2)
 	{
-		puts("blur [kernel size] [filename in] [filename out]"
+		puts("blur [options] [kernel size] [filename in] [filename out] ..."
 		     "\n\n\tBlurs the image with a kernel of specified size."
 		     "\n\tThe kernel size determines the amount of blur."
-		     "\n\tKernel size may be decimal, e.g 1.5 pixels.");
+		     "\n\tKernel size may be decimal, e.g 1.5 pixels."
+		     "\n\tMore images can follow, as pairs of filenames."
+		     "\n\n\t-t n        Use n worker threads, default one per CPU."
+		     "\n\t-pin        Pin worker threads to CPUs."
+		     "\n\t-passes n   Blur each image n times."
+		     "\n\t-fft        Always convolve with FFTs."
+		     "\n\t-direct     Never convolve with FFTs, by default wide"
+		     "\n\t            kernels are."
+		     "\n\t-shape s    Kernel shape, ring (default) or disc."
+		     "\n\t-fast       Blur with a flat disc of boxes, for previews."
+		     "\n\t-separable n Approximate the kernel with at most n"
+		     "\n\t            separable components, up to 16."
+		     "\n\t-border m   Read pixels outside the image as mirror"
+		     "\n\t            (default), clamp, wrap or constant (black)."
+		     "\n\t-zblur f    Blur by depth, focused at depth f, 0 to 1."
+		     "\n\t            Images come as input, depth, output. The"
+		     "\n\t            kernel size is the blur at a depth 1 from"
+		     "\n\t            focus.");
 		goto die;
 	}
 	else if (argc < 3)
@@ -508,9 +2423,15 @@ void cmd_args_init(int argc, char **argv)
 		LOG("ARG", "Missing input filename.\n");
 		goto die;
 	}
-	else if (argc < 4)
+	cmd_args.set_size = cmd_args.zblur? 3 : 2;
+	if (argc < 2 + cmd_args.set_size)
 	{
-		LOG("ARG", "Missing output filename.\n");
+		LOG("ARG", cmd_args.zblur? "Missing depth or output filename.\n" : "Missing output filename.\n");
+		goto die;
+	}
+	else if ((argc - 2) % cmd_args.set_size != 0)
+	{
+		LOG("ARG", "Missing filenames for the last input.\n");
 		goto die;
 	}
 
@@ -520,12 +2441,26 @@ void cmd_args_init(int argc, char **argv)
 		LOG("ARG", "Negative kernel size or kernel size < 1.0 makes no sense.\n");
 		goto die;
 	}
+	if (cmd_args.passes < 1)
+	{
+		LOG("ARG", "At least one pass is needed.\n");
+		goto die;
+	}
+	if (cmd_args.zblur && cmd_args.convolution != CONV_AUTO && cmd_args.convolution != CONV_FAST)
+	{
+		LOG("ARG", "The depth of field blur has its own convolution, or -fast.\n");
+		goto die;
+	}
+	if (cmd_args.convolution == CONV_SEPARABLE 
+		&& (cmd_args.components < 1 || cmd_args.components > SEPARABLE_MAX_COMPONENTS))
+	{
+		LOG("ARG", "The separable convolution needs 1 to 16 components.\n");
+		goto die;
+	}
 
 	cmd_args.kernel_size = (float) kernel_size_d;
-	cmd_args.input_file = argv[2];
-	cmd_args.output_file = argv[3];
-
-	LOGF("ARG", "Processing %s -> %s, K-size: %f.\n", cmd_args.input_file, cmd_args.output_file, cmd_args.kernel_size);
+	cmd_args.files = argv + 2;
+	cmd_args.file_sets = (argc - 2) / cmd_args.set_size;
 
 	return;
 die:
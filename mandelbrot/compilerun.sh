@@ -1,3 +1,3 @@
-cc -O2 -Wall -std=c99 mandelbrot.c -o mandelbrot
+cc -O2 -Wall -std=c99 mandelbrot.c -o mandelbrot -lm -pthread
 ./mandelbrot
 rm mandelbrot mandelbrot.exe
\ No newline at end of file
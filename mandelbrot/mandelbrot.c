@@ -26,11 +26,23 @@
 	Use GCC or Clang with std=c99, or something else that supports C99.
 */
 
+#define _POSIX_C_SOURCE 200809L
+
+#include "limits.h"
 #include "stdint.h"
 #include "stdio.h"
 #include "stdlib.h"
+#include "string.h"
 #include "math.h"
 #include "complex.h"
+#include "sys/stat.h"
+#include "sys/socket.h"
+#include "sys/un.h"
+#include "netinet/in.h"
+#include "arpa/inet.h"
+#include "unistd.h"
+#include "signal.h"
+#include "pthread.h"
 
 #define RERROR(reason, code) \
 	{ \
@@ -148,87 +160,1814 @@ void tga_write(tga_data *data, FILE *f)
 	}
 }
 
-int draw_pixel(double complex c, int x, int y, tga_data *tga)
-{	
-	int const iterations = 500;
+/*
+	VIEW.
+*/
+typedef struct view_s
+{
+	unsigned int width;
+	unsigned int height;
+	/* 
+		The point in the complex plane at the center of the picture.
 
-	/* For debugging.
-	printf("x: %d, y: %d\n", x, y);
-	printf("%f + i%f\n", creal(c), cimag(c));
+		Kept in long double so the reference orbit can be computed a
+		bit more precisely than the per pixel deltas.
 	*/
+	long double center_re;
+	long double center_im;
+	/* How many units of the complex plane the shortest side spans. */
+	double scale;
+	int iterations;
+	/* Non-zero if the series approximation may be used. */
+	int series;
+} view;
+
+/*
+	Returns the offset of pixel (x, y) from the center of the view.
+*/
+double complex view_delta(view const *v, unsigned int x, unsigned int y)
+{
+	double unit_length = v->width < v->height? v->width : v->height;
+
+	double xd = x; xd = ((xd - (v->width * 0.5)) / unit_length) * v->scale;
+	double yd = y; yd = ((yd - (v->height * 0.5)) / unit_length) * v->scale;
+
+	return xd + (yd * I);
+}
+
+/*
+	SERIES APPROXIMATION.
+
+	At deep zooms every pixel follows the orbit of the view center for a
+	long time. We iterate that reference orbit once, Z, and then only
+	track the difference d to it for each pixel:
+
+		d_n+1 = 2 Z_n d_n + d_n^2 + dc
+
+	d_n can be approximated by a polynomial in the pixel offset dc:
+
+		d_n ~ A_n dc + B_n dc^2 + C_n dc^3
+
+		A_n+1 = 2 Z_n A_n + 1
+		B_n+1 = 2 Z_n B_n + A_n^2
+		C_n+1 = 2 Z_n C_n + 2 A_n B_n
+
+	so as long as the polynomial holds for the whole frame, every pixel 
+	can start at iteration n instead of zero.
+*/
+
+/* Relative error allowed between the series and probe points. */
+#define SA_TOLERANCE		1e-6
+/* 
+	A perturbed iteration costs about 1.6 plain ones, so the series 
+	only pays when it skips at least this fraction of the iterations.
+	Measured from 1e-2 to 1e-13 zooms, where the two break even at 
+	about a fifth.
+*/
+#define SA_MIN_SKIP_FRACTION	0.2
+/* A pixel orbit this much closer to zero than the reference is glitched. */
+#define SA_GLITCH_TOLERANCE	1e-3
+
+typedef struct reference_orbit_s
+{
+	/* Z_0 to Z_(length - 1), rounded to double. */
+	double complex *z;
+	int length;
+	/* Iterations every pixel may skip. */
+	int skip;
+	/* Series coefficients A, B and C at iteration skip. */
+	double complex a;
+	double complex b;
+	double complex c;
+
+	/* What the orbit was iterated for. */
+	long double center_re;
+	long double center_im;
+	int iterations;
+} reference_orbit;
+
+void reference_orbit_series(reference_orbit *ref, view const *v);
+
+/*
+	Iterates the orbit of the view center and finds how far the series
+	approximation may be used.
+
+	Returns NULL on out of memory.
+*/
+reference_orbit *reference_orbit_create(view const *v)
+{
+	reference_orbit *ref = malloc(sizeof(reference_orbit));
+	if (ref == NULL)
+		return NULL;
+
+	ref->z = malloc((v->iterations + 1) * sizeof(double complex));
+	if (ref->z == NULL)
+	{
+		free(ref);
+		return NULL;
+	}
+
+	ref->center_re = v->center_re;
+	ref->center_im = v->center_im;
+	ref->iterations = v->iterations;
+
+	long double complex center = v->center_re + (v->center_im * I);
+	long double complex zl = 0.0L;
+	int n = 0;
+	for (; n <= v->iterations; n++)
+	{
+		ref->z[n] = zl;
+		if (cabsl(zl) > 2.0L)
+		{
+			n++;
+			break;
+		}
+		zl = (zl * zl) + center;
+	}
+	ref->length = n;
+
+	reference_orbit_series(ref, v);
+
+	return ref;
+}
+
+/*
+	Returns non-zero if ref was iterated for the same center and 
+	iteration count as v, in which case only the series needs to be 
+	redone for v.
+*/
+int reference_orbit_matches(reference_orbit const *ref, view const *v)
+{
+	return ref->center_re == v->center_re
+	    && ref->center_im == v->center_im
+	    && ref->iterations == v->iterations;
+}
+
+/*
+	Finds how far the series approximation may be used for the view v, 
+	which must have the same center as the reference orbit.
+
+	The validity check runs a handful of probe pixels along the image 
+	border with exact perturbation and stops where the series starts to 
+	disagree with any of them.
+*/
+void reference_orbit_series(reference_orbit *ref, view const *v)
+{
+	unsigned int const w = v->width - 1;
+	unsigned int const h = v->height - 1;
+	double complex probe_dc[8] = 
+	{
+		view_delta(v, 0, 0),     view_delta(v, w / 2, 0),
+		view_delta(v, w, 0),     view_delta(v, w, h / 2),
+		view_delta(v, w, h),     view_delta(v, w / 2, h),
+		view_delta(v, 0, h),     view_delta(v, 0, h / 2)
+	};
+	double complex probe_d[8] = {0};
+
+	double complex a = 0.0, b = 0.0, c = 0.0;
+	int n = 0;
+	for (; n + 1 < ref->length; n++)
+	{
+		double complex const zn = ref->z[n];
+		double complex const na = (2.0 * zn * a) + 1.0;
+		double complex const nb = (2.0 * zn * b) + (a * a);
+		double complex const nc = (2.0 * zn * c) + (2.0 * a * b);
+
+		int valid = 1;
+		for (int p = 0; p < 8; p++)
+		{
+			double complex const dc = probe_dc[p];
+			double complex const d = 
+				(2.0 * zn * probe_d[p]) + (probe_d[p] * probe_d[p]) + dc;
+			double complex const approx = (na * dc) + (nb * dc * dc) + (nc * dc * dc * dc);
+
+			if (cabs(approx - d) > SA_TOLERANCE * cabs(d)
+			 || cabs(ref->z[n + 1] + d) > 2.0)
+			{
+				valid = 0;
+				break;
+			}
+			probe_d[p] = d;
+		}
+		if (!valid)
+			break;
+
+		a = na; b = nb; c = nc;
+	}
+
+	ref->skip = n;
+	ref->a = a;
+	ref->b = b;
+	ref->c = c;
+}
+
+/*
+	Returns non-zero if ref skips enough iterations for the perturbed 
+	escape loop to be faster than the plain one.
+*/
+int reference_orbit_pays(reference_orbit const *ref)
+{
+	return ref != NULL && ref->skip >= SA_MIN_SKIP_FRACTION * ref->iterations;
+}
+
+void reference_orbit_free(reference_orbit *ref)
+{
+	if (ref != NULL)
+		free(ref->z);
+	free(ref);
+}
+
+/*
+	ESCAPE TIME.
+*/
 
+/*
+	|z|^2, escape and glitch tests compare these to keep square roots 
+	out of the loops.
+*/
+double norm2(double complex z)
+{
+	return creal(z) * creal(z) + cimag(z) * cimag(z);
+}
+
+/*
+	Returns the number of iterations before the orbit of c escapes, or
+	iterations if it doesn't.
+
+	|z| at the time of escape is stored in final_abs, it is needed for 
+	smooth colouring.
+*/
+int escape_time(double complex c, int iterations, float *final_abs)
+{
 	double complex z = 0.0 + 0.0 * I;
 	int i = 0;
 	for (; i < iterations; i++)
 	{	
-		if (cabs(z) > 2.0)
+		if (norm2(z) > 4.0)
 			break;
 		z = (z * z) + c;
 	}
 
-	int in_set = cabs(z) < 2.0;
+	*final_abs = cabs(z);
+	return i;
+}
+
+/*
+	Same as escape_time, but starts at the skipped iteration of the 
+	reference orbit and iterates the difference dc = c - center.
+
+	Glitched pixels fall back to the full iteration.
+*/
+int escape_time_perturbed(
+	reference_orbit const *ref, 
+	double complex c, 
+	double complex dc, 
+	int iterations,
+	float *final_abs)
+{
+	double complex d = (ref->a * dc) + (ref->b * dc * dc) + (ref->c * dc * dc * dc);
+
+	int i = ref->skip;
+	double complex z = ref->z[i] + d;
+	for (; i < iterations; i++)
+	{
+		double const z2 = norm2(z);
+		if (z2 > 4.0)
+			break;
+
+		if (i + 1 < ref->length)
+		{
+			double complex const zn = ref->z[i];
+			if (z2 < SA_GLITCH_TOLERANCE * SA_GLITCH_TOLERANCE * norm2(zn))
+				return escape_time(c, iterations, final_abs);
+
+			d = (2.0 * zn * d) + (d * d) + dc;
+			z = ref->z[i + 1] + d;
+		}
+		else
+		{
+			/* The reference escaped before us, go on without it. */
+			z = (z * z) + c;
+		}
+	}
+
+	*final_abs = cabs(z);
+	return i;
+}
+
+/*
+	ITERATION BUFFERS.
+
+	The escape engine only produces iteration counts and |z| at escape 
+	for every pixel. Colouring is a separate pass over the buffer, so 
+	a picture can be recoloured without rendering it again, also from 
+	a buffer saved to disk.
+*/
+typedef struct iteration_buffer_s
+{
+	unsigned int width;
+	unsigned int height;
+	/* The iteration limit the buffer was rendered with. */
+	uint32_t iterations;
+	/* 
+		Escape time per pixel, from top left to bottom right. Equal to
+		iterations for pixels inside the set.
+	*/
+	uint32_t *count;
+	/* |z| at escape per pixel. */
+	float *final_abs;
+} iteration_buffer;
+
+/*
+	Returns NULL on out of memory.
+*/
+iteration_buffer *iteration_buffer_create(unsigned int w, unsigned int h, uint32_t iterations)
+{
+	iteration_buffer *buf = malloc(sizeof(iteration_buffer));
+	if (buf == NULL)
+		return NULL;
+
+	uint64_t const pixels = (uint64_t) w * h;
+	buf->width = w;
+	buf->height = h;
+	buf->iterations = iterations;
+	buf->count = malloc(pixels * sizeof(uint32_t));
+	buf->final_abs = malloc(pixels * sizeof(float));
+	if (buf->count == NULL || buf->final_abs == NULL)
+	{
+		free(buf->count);
+		free(buf->final_abs);
+		free(buf);
+		return NULL;
+	}
+	return buf;
+}
+
+void iteration_buffer_free(iteration_buffer *buf)
+{
+	if (buf != NULL)
+	{
+		free(buf->count);
+		free(buf->final_abs);
+	}
+	free(buf);
+}
+
+/*
+	On disk a buffer is the 4 byte magic ITERATION_BUFFER_MAGIC, then 
+	width, height and iterations as 32-bit integers, then the counts 
+	and finally the |z| values. Everything in native byte order.
+*/
+#define ITERATION_BUFFER_MAGIC	"MBI1"
 
-	int r = pow(1.0 - (i / (double) iterations), 15) * 255.9;
+/*
+	Returns 0 on success.
+*/
+int iteration_buffer_write(iteration_buffer const *buf, FILE *f)
+{
+	uint64_t const pixels = (uint64_t) buf->width * buf->height;
+	uint32_t const header[3] = {buf->width, buf->height, buf->iterations};
 
-	int stride = (x + (y * tga->width)) * 3;
-	/* TGA is stored BGR. */
-	tga->data[stride + 2] = 255 - r;
-	tga->data[stride + 1] = 255 - r;
-	tga->data[stride + 0] = 255 - r;
+	if (fwrite(ITERATION_BUFFER_MAGIC, 4, 1, f) != 1
+	 || fwrite(header, sizeof(header), 1, f) != 1
+	 || fwrite(buf->count, sizeof(uint32_t), pixels, f) != pixels
+	 || fwrite(buf->final_abs, sizeof(float), pixels, f) != pixels)
+		return 1;
 
 	return 0;
 }
 
-int draw_picture(unsigned int width, unsigned int height, char const *filename)
+/*
+	Returns NULL if the file isn't a buffer or on out of memory. Files 
+	with an iteration count a view can't have, or counts past it, are
+	not buffers either: the palettes are indexed by the counts.
+*/
+iteration_buffer *iteration_buffer_read(FILE *f)
 {
-	if (width < 2 || height < 2)
-		RERROR("Error: Dimensions may not be less than 2x2 pixels.", 
-			    ERROR_DIMENSIONS_TO_SMALL);
+	char magic[4];
+	uint32_t header[3];
+	if (fread(magic, 4, 1, f) != 1 || memcmp(magic, ITERATION_BUFFER_MAGIC, 4) != 0)
+		return NULL;
+	if (fread(header, sizeof(header), 1, f) != 1 || header[0] < 2 || header[1] < 2 
+	 || header[2] < 1 || header[2] > INT_MAX)
+		return NULL;
 
-	FILE *f = fopen(filename, "wb+");
-	if (!f)
-		RERROR("Error: Unable to open file for reading.", ERROR_FILE_LOCKED);
+	iteration_buffer *buf = iteration_buffer_create(header[0], header[1], header[2]);
+	if (buf == NULL)
+		return NULL;
 
-	tga_data *tga = tga_create(width, height, 24);
-	if (tga == 0)
+	uint64_t const pixels = (uint64_t) buf->width * buf->height;
+	if (fread(buf->count, sizeof(uint32_t), pixels, f) != pixels
+	 || fread(buf->final_abs, sizeof(float), pixels, f) != pixels)
 	{
-		fclose(f);
-		RERROR("Error: Could not create TGA data, memory error perhaps.", ERROR_TGA_CREATION);
+		iteration_buffer_free(buf);
+		return NULL;
+	}
+	for (uint64_t p = 0; p < pixels; p++)
+	{
+		if (buf->count[p] > buf->iterations)
+		{
+			iteration_buffer_free(buf);
+			return NULL;
+		}
 	}
+	return buf;
+}
 
-	/*
-		Determine the size of the unit disk.
-	*/
-	double unit_length = width < height? width : height;
+/*
+	COLOURING.
+
+	Palettes are lookup tables of BGR triplets. 
+
+	The classic palette is indexed directly by the iteration count and 
+	holds the original pow(1 - i / iterations, 15) ramp.
+
+	The smooth palette is a repeating gradient indexed by the normalised 
+	iteration count
 
-	double world_scale = 2.5;
-	double x_offset = 0.5;
+		mu = i + 1 - log2(log|z| / log 2)
 
-	for (unsigned int y = 0; y < height; ++y)
+	which removes the banding of the integer counts.
+*/
+#define PALETTE_CLASSIC			0
+#define PALETTE_SMOOTH			1
+#define PALETTE_SMOOTH_SIZE		1024
+
+typedef struct palette_s
+{
+	int type;
+	/* BGR triplets. */
+	uint8_t *lut;
+	uint32_t size;
+	/* Palette entries per iteration, for the smooth palette. */
+	float density;
+} palette;
+
+/*
+	Returns 0 on out of memory, an unknown palette type or more 
+	iterations than the classic palette can hold.
+*/
+int palette_init(palette *pal, int type, uint32_t iterations, float density)
+{
+	pal->type = type;
+	pal->density = density;
+
+	if (type == PALETTE_CLASSIC)
 	{
-		for (unsigned int x = 0; x < width; ++x)
+		if (iterations < 1 || iterations > INT_MAX)
+			return 0;
+		pal->size = iterations + 1;
+		pal->lut = malloc((size_t) pal->size * 3);
+		if (pal->lut == NULL)
+			return 0;
+
+		for (uint32_t i = 0; i < pal->size; i++)
+		{
+			int r = pow(1.0 - (i / (double) iterations), 15) * 255.9;
+			pal->lut[i * 3 + 0] = 255 - r;
+			pal->lut[i * 3 + 1] = 255 - r;
+			pal->lut[i * 3 + 2] = 255 - r;
+		}
+		return 1;
+	}
+	else if (type == PALETTE_SMOOTH)
+	{
+		/* Gradient stops, RGB. */
+		static uint8_t const stops[5][3] =
 		{
-			double xd = x; xd = ((xd - (width * 0.5)) / unit_length) * world_scale;
-			double yd = y; yd = ((yd - (height * 0.5)) / unit_length) * world_scale;
+			{  0,   7, 100},
+			{ 32, 107, 203},
+			{237, 255, 255},
+			{255, 170,   0},
+			{  0,   2,   0}
+		};
 
-			double complex c = (xd - x_offset) + (yd * I);
+		pal->size = PALETTE_SMOOTH_SIZE;
+		pal->lut = malloc(pal->size * 3);
+		if (pal->lut == NULL)
+			return 0;
 
-			draw_pixel(c, x, y, tga);
+		for (uint32_t i = 0; i < pal->size; i++)
+		{
+			float t = (i / (float) pal->size) * 5.0f;
+			int s0 = (int) t;
+			int s1 = (s0 + 1) % 5;
+			float f = t - s0;
+			for (int ch = 0; ch < 3; ch++)
+			{
+				float v = stops[s0][ch] * (1.0f - f) + stops[s1][ch] * f;
+				/* TGA is stored BGR. */
+				pal->lut[i * 3 + (2 - ch)] = (uint8_t) (v + 0.5f);
+			}
 		}
+		return 1;
 	}
+	return 0;
+}
 
-	tga_write(tga, f);
+void palette_free(palette *pal)
+{
+	free(pal->lut);
+	pal->lut = NULL;
+}
 
-	tga_free(tga);
-	fclose(f);
+/*
+	Colours every pixel of buf into tga, which must have the same 
+	dimensions and be 24-bit.
+*/
+void colour_iterations(iteration_buffer const *buf, palette const *pal, tga_data *tga)
+{
+	uint64_t const pixels = (uint64_t) buf->width * buf->height;
+	uint32_t const *count = buf->count;
+	uint8_t *out = tga->data;
 
-	return 0;
+	if (pal->type == PALETTE_CLASSIC)
+	{
+		for (uint64_t p = 0; p < pixels; p++)
+		{
+			uint8_t const *c = pal->lut + count[p] * 3;
+			out[p * 3 + 0] = c[0];
+			out[p * 3 + 1] = c[1];
+			out[p * 3 + 2] = c[2];
+		}
+		return;
+	}
+
+	float const *final_abs = buf->final_abs;
+	float const inv_log2 = 1.0f / logf(2.0f);
+	for (uint64_t p = 0; p < pixels; p++)
+	{
+		if (count[p] >= buf->iterations)
+		{
+			/* Inside the set. */
+			out[p * 3 + 0] = 0;
+			out[p * 3 + 1] = 0;
+			out[p * 3 + 2] = 0;
+			continue;
+		}
+
+		float log_z = logf(final_abs[p] > 1.0f? final_abs[p] : 1.0f);
+		float nu = log_z > 0.0f? logf(log_z * inv_log2) * inv_log2 : 0.0f;
+		float mu = count[p] + 1.0f - nu;
+		float entry = (mu < 0.0f? 0.0f : mu) * pal->density;
+
+		uint32_t const i0 = ((uint32_t) entry) % pal->size;
+		uint32_t const i1 = (i0 + 1) % pal->size;
+		float const f = entry - floorf(entry);
+		uint8_t const *c0 = pal->lut + i0 * 3;
+		uint8_t const *c1 = pal->lut + i1 * 3;
+		out[p * 3 + 0] = (uint8_t) (c0[0] + (c1[0] - c0[0]) * f);
+		out[p * 3 + 1] = (uint8_t) (c0[1] + (c1[1] - c0[1]) * f);
+		out[p * 3 + 2] = (uint8_t) (c0[2] + (c1[2] - c0[2]) * f);
+	}
 }
 
-int main(int argc, char *argv[])
+/*
+	ZOOM SEQUENCES.
+
+	Frames of a zoom all share the view center, so the reference orbit 
+	is iterated once for the whole sequence.
+
+	When zooming in, every pixel of a frame lies inside the previous 
+	frame. If all the previous frame's pixels around it escaped at the 
+	same iteration we guess that this one does too, and don't iterate 
+	it. Like all such guessing it can miss details thinner than a pixel 
+	of the previous frame, so every REUSE_KEYFRAME:th frame is rendered 
+	in full to stop errors from piling up.
+*/
+#define REUSE_KEYFRAME		8
+
+typedef struct previous_frame_s
+{
+	iteration_buffer const *buf;
+	double scale;
+} previous_frame;
+
+/*
+	Returns the index of the previous frame's pixel at the point dc if
+	it and all its neighbours escaped at the same iteration, otherwise 
+	UINT64_MAX.
+*/
+uint64_t previous_frame_guess(
+	previous_frame const *prev, 
+	view const *v, 
+	double complex dc)
+{
+	double unit_length = v->width < v->height? v->width : v->height;
+	double px = (creal(dc) / prev->scale) * unit_length + (v->width * 0.5);
+	double py = (cimag(dc) / prev->scale) * unit_length + (v->height * 0.5);
+
+	long x0 = (long) floor(px + 0.5) - 1;
+	long y0 = (long) floor(py + 0.5) - 1;
+	if (x0 < 0 || y0 < 0 || x0 + 2 >= v->width || y0 + 2 >= v->height)
+		return UINT64_MAX;
+
+	uint32_t const *count = prev->buf->count;
+	uint32_t const first = count[x0 + y0 * v->width];
+	for (long y = y0; y < y0 + 3; y++)
+	{
+		for (long x = x0; x < x0 + 3; x++)
+		{
+			if (count[x + y * v->width] != first)
+				return UINT64_MAX;
+		}
+	}
+	return (x0 + 1) + (uint64_t) (y0 + 1) * v->width;
+}
+
+/*
+	Fills buf with the escape time of every pixel in the buf->width by
+	buf->height region of the view, whose upper left corner is (x0, y0).
+
+	ref may be NULL, in which case every pixel is iterated directly. 
+	prev may be NULL, otherwise it is used to guess pixels as described 
+	above. Guessing requires the region to be the whole view.
+
+	Returns the number of pixels that were guessed.
+*/
+uint64_t render_iterations(
+	view const *v, 
+	reference_orbit const *ref, 
+	previous_frame const *prev, 
+	unsigned int x0,
+	unsigned int y0,
+	iteration_buffer *buf)
+{
+	double const center_re = v->center_re;
+	double const center_im = v->center_im;
+	uint64_t guessed = 0;
+
+	for (unsigned int y = 0; y < buf->height; ++y)
+	{
+		for (unsigned int x = 0; x < buf->width; ++x)
+		{
+			uint64_t const p = x + (uint64_t) y * buf->width;
+			double complex dc = view_delta(v, x0 + x, y0 + y);
+
+			if (prev != NULL)
+			{
+				uint64_t source = previous_frame_guess(prev, v, dc);
+				if (source != UINT64_MAX)
+				{
+					buf->count[p] = prev->buf->count[source];
+					buf->final_abs[p] = prev->buf->final_abs[source];
+					guessed++;
+					continue;
+				}
+			}
+
+			double complex c = (center_re + creal(dc)) + ((center_im + cimag(dc)) * I);
+
+			buf->count[p] = reference_orbit_pays(ref)? 
+				escape_time_perturbed(ref, c, dc, v->iterations, buf->final_abs + p) :
+				escape_time(c, v->iterations, buf->final_abs + p);
+		}
+	}
+
+	return guessed;
+}
+
+typedef struct render_options_s
+{
+	/* Number of frames and how much each frame zooms. */
+	int frames;
+	double zoom;
+	/* Non-zero to guess pixels from the previous frame. */
+	int reuse;
+	/* PALETTE_CLASSIC or PALETTE_SMOOTH, and its density. */
+	int palette;
+	float density;
+	/* TGA file name or pattern, "-" for stdout. */
+	char const *filename;
+	/* Iteration buffer file name or pattern, NULL to not save them. */
+	char const *save;
+	/* Side of the tiles of a poster, 0 to render a single picture. */
+	unsigned int tile;
+} render_options;
+
+/*
+	Returns non-zero if pattern is a printf pattern with exactly one 
+	int conversion, such as %04d, and no other conversions than %%.
+*/
+int frame_pattern_valid(char const *pattern)
+{
+	int conversions = 0;
+	for (char const *c = pattern; *c; c++)
+	{
+		if (*c != '%')
+			continue;
+		if (*++c == '%')
+			continue;
+		while (*c && strchr("-+ #0", *c))
+			c++;
+		while (*c >= '0' && *c <= '9')
+			c++;
+		if (*c == '.')
+		{
+			c++;
+			while (*c >= '0' && *c <= '9')
+				c++;
+		}
+		if (!*c || !strchr("diuxXo", *c))
+			return 0;
+		conversions++;
+	}
+	return conversions == 1;
+}
+
+/*
+	Formats the file name of a frame. With more than one frame the 
+	name is a printf pattern taking the frame number, checked with 
+	frame_pattern_valid.
+*/
+void frame_filename(char *name, size_t size, char const *pattern, int frames, int frame)
+{
+	if (frames > 1)
+		snprintf(name, size, pattern, frame);
+	else
+		snprintf(name, size, "%s", pattern);
+}
+
+/*
+	Writes tga to the frame's file, or to stdout for "-".
+
+	Returns 0 on success, ERROR_TGA_WRITE if the frame couldn't be 
+	written in full.
+*/
+int write_frame(tga_data *tga, render_options const *opt, int frame)
 {
-	int w = 1920;
-	int h = 1080;
-	int mult = 1;
-	return draw_picture(w*mult, h*mult, "mandelbrot.tga");
-}
\ No newline at end of file
+	if (strcmp(opt->filename, "-") == 0)
+	{
+		tga_write(tga, stdout);
+		if (fflush(stdout) != 0 || ferror(stdout))
+		{
+			/* Not on stdout, that's where the frames go. */
+			fputs("Error: Unable to write frame.\n", stderr);
+			return ERROR_TGA_WRITE;
+		}
+		return 0;
+	}
+
+	char name[4096];
+	frame_filename(name, sizeof(name), opt->filename, opt->frames, frame);
+
+	FILE *f = fopen(name, "wb+");
+	if (!f)
+		RERROR("Error: Unable to open file for reading.", ERROR_FILE_LOCKED);
+
+	tga_write(tga, f);
+	int const write_error = ferror(f);
+	if (fclose(f) != 0 || write_error)
+		RERROR("Error: Unable to write frame.", ERROR_TGA_WRITE);
+	return 0;
+}
+
+/*
+	Renders opt->frames pictures zooming in on the center of v, each 
+	frame opt->zoom times the scale of the one before. One frame 
+	renders just v.
+
+	If the file name is "-" the frames are written one after another to 
+	stdout, so they can be piped to an encoder. Otherwise, when there 
+	is more than one frame, it is a printf pattern taking the frame 
+	number, e.g. "zoom_%04d.tga".
+
+	Each frame is written out as soon as it is done.
+*/
+int draw_picture(view const *v, render_options const *opt)
+{
+	if (v->width < 2 || v->height < 2)
+		RERROR("Error: Dimensions may not be less than 2x2 pixels.", 
+			    ERROR_DIMENSIONS_TO_SMALL);
+
+	palette pal;
+	if (!palette_init(&pal, opt->palette, v->iterations, opt->density))
+		RERROR("Error: Could not create palette, memory error perhaps.", ERROR_TGA_CREATION);
+
+	tga_data *tga = tga_create(v->width, v->height, 24);
+	iteration_buffer *buf = iteration_buffer_create(v->width, v->height, v->iterations);
+	iteration_buffer *prev_buf = opt->reuse? 
+		iteration_buffer_create(v->width, v->height, v->iterations) : NULL;
+	if (tga == 0 || buf == NULL || (opt->reuse && prev_buf == NULL))
+	{
+		tga_free(tga);
+		iteration_buffer_free(buf);
+		iteration_buffer_free(prev_buf);
+		palette_free(&pal);
+		RERROR("Error: Could not create TGA data, memory error perhaps.", ERROR_TGA_CREATION);
+	}
+
+	uint64_t const pixels = (uint64_t) v->width * v->height;
+	view fv = *v;
+	reference_orbit *ref = NULL;
+	previous_frame prev = {prev_buf, 0.0};
+	int error = 0;
+
+	for (int frame = 0; frame < opt->frames && !error; frame++)
+	{
+		if (fv.series)
+		{
+			if (ref != NULL && reference_orbit_matches(ref, &fv))
+				reference_orbit_series(ref, &fv);
+			else
+			{
+				reference_orbit_free(ref);
+				ref = reference_orbit_create(&fv);
+				if (ref == NULL)
+				{
+					puts("Error: Could not create reference orbit, memory error perhaps.");
+					error = ERROR_TGA_CREATION;
+					break;
+				}
+			}
+		}
+
+		int const guess = opt->reuse && frame % REUSE_KEYFRAME != 0;
+		uint64_t guessed = render_iterations(&fv, ref, guess? &prev : NULL, 0, 0, buf);
+		colour_iterations(buf, &pal, tga);
+
+		fprintf(stderr, "Frame %d: scale %g, series skips %d of %d iterations, %.1f%% of pixels reused.\n",
+			frame, fv.scale, reference_orbit_pays(ref)? ref->skip : 0, fv.iterations, 
+			100.0 * guessed / (double) pixels);
+
+		error = write_frame(tga, opt, frame);
+
+		if (!error && opt->save != NULL)
+		{
+			char name[4096];
+			frame_filename(name, sizeof(name), opt->save, opt->frames, frame);
+
+			FILE *f = fopen(name, "wb+");
+			if (!f || iteration_buffer_write(buf, f) != 0)
+			{
+				puts("Error: Unable to write iteration buffer.");
+				error = ERROR_FILE_LOCKED;
+			}
+			if (f)
+				fclose(f);
+		}
+
+		if (opt->reuse)
+		{
+			iteration_buffer *t = prev_buf; prev_buf = buf; buf = t;
+			prev.buf = prev_buf;
+			prev.scale = fv.scale;
+		}
+
+		fv.scale *= opt->zoom;
+	}
+
+	reference_orbit_free(ref);
+	iteration_buffer_free(buf);
+	iteration_buffer_free(prev_buf);
+	tga_free(tga);
+	palette_free(&pal);
+
+	return error;
+}
+
+/*
+	Colours an iteration buffer saved with -save into a picture, without
+	rendering anything.
+*/
+int recolour_picture(char const *load, render_options const *opt)
+{
+	FILE *f = fopen(load, "rb");
+	if (!f)
+		RERROR("Error: Unable to open file for reading.", ERROR_FILE_LOCKED);
+
+	iteration_buffer *buf = iteration_buffer_read(f);
+	fclose(f);
+	if (buf == NULL)
+		RERROR("Error: Could not read iteration buffer.", ERROR_TGA_CREATION);
+
+	palette pal;
+	tga_data *tga = tga_create(buf->width, buf->height, 24);
+	if (tga == 0 || !palette_init(&pal, opt->palette, buf->iterations, opt->density))
+	{
+		tga_free(tga);
+		iteration_buffer_free(buf);
+		RERROR("Error: Could not create TGA data, memory error perhaps.", ERROR_TGA_CREATION);
+	}
+
+	colour_iterations(buf, &pal, tga);
+	int error = write_frame(tga, opt, 0);
+
+	palette_free(&pal);
+	tga_free(tga);
+	iteration_buffer_free(buf);
+
+	return error;
+}
+
+/*
+	POSTERS.
+
+	Pictures too large for memory, or for the 65535 pixel sides of a 
+	TGA, are rendered as a grid of tiles into a directory. Only one 
+	tile is in memory at a time.
+
+	The directory holds a text manifest, POSTER_MANIFEST, describing 
+	the poster and its grid, and one TGA per tile named by 
+	POSTER_TILE_PATTERN with the column and row. Tiles are written under
+	a temporary name and renamed when complete, so an interrupted render 
+	can be resumed by running the same command again: tiles that exist
+	are skipped. A manifest that doesn't match the command is an error
+	rather than being mixed with new tiles.
+*/
+#define POSTER_MANIFEST			"poster.txt"
+#define POSTER_TILE_PATTERN		"tile_%05u_%05u.tga"
+
+/*
+	Writes the manifest for the poster into text. Returns its length.
+*/
+int poster_manifest(char *text, size_t size, view const *v, render_options const *opt)
+{
+	unsigned int const columns = (v->width + opt->tile - 1) / opt->tile;
+	unsigned int const rows = (v->height + opt->tile - 1) / opt->tile;
+
+	return snprintf(text, size,
+		"mandelbrot poster\n"
+		"width %u\n"
+		"height %u\n"
+		"tile %u\n"
+		"columns %u\n"
+		"rows %u\n"
+		"center %.21Lg %.21Lg\n"
+		"scale %.17g\n"
+		"iterations %d\n"
+		"palette %s\n"
+		"density %.9g\n"
+		"tiles %s column row\n",
+		v->width, v->height, opt->tile, columns, rows,
+		v->center_re, v->center_im, v->scale, v->iterations,
+		opt->palette == PALETTE_SMOOTH? "smooth" : "classic", opt->density,
+		POSTER_TILE_PATTERN);
+}
+
+int draw_poster(view const *v, render_options const *opt)
+{
+	if (v->width < 2 || v->height < 2)
+		RERROR("Error: Dimensions may not be less than 2x2 pixels.", 
+			    ERROR_DIMENSIONS_TO_SMALL);
+	if (opt->tile < 2 || opt->tile > 65535)
+		RERROR("Error: Tile size must be between 2 and 65535 pixels.", 
+			    ERROR_DIMENSIONS_TO_SMALL);
+
+	char const *dir = opt->filename;
+	mkdir(dir, 0777);
+
+	char manifest[1024];
+	int const manifest_len = poster_manifest(manifest, sizeof(manifest), v, opt);
+
+	char name[4096];
+	snprintf(name, sizeof(name), "%s/%s", dir, POSTER_MANIFEST);
+	FILE *f = fopen(name, "rb");
+	if (f)
+	{
+		char existing[1024];
+		size_t len = fread(existing, 1, sizeof(existing), f);
+		fclose(f);
+		if (len != manifest_len || memcmp(existing, manifest, len) != 0)
+			RERROR("Error: Directory holds a different poster.", ERROR_FILE_LOCKED);
+	}
+	else
+	{
+		f = fopen(name, "wb");
+		if (!f)
+			RERROR("Error: Unable to open file for reading.", ERROR_FILE_LOCKED);
+		fwrite(manifest, 1, manifest_len, f);
+		fclose(f);
+	}
+
+	palette pal;
+	if (!palette_init(&pal, opt->palette, v->iterations, opt->density))
+		RERROR("Error: Could not create palette, memory error perhaps.", ERROR_TGA_CREATION);
+
+	/*
+		The series is validated against the border of the whole poster,
+		so it holds for every tile.
+	*/
+	reference_orbit *ref = v->series? reference_orbit_create(v) : NULL;
+	iteration_buffer *buf = iteration_buffer_create(opt->tile, opt->tile, v->iterations);
+	if ((v->series && ref == NULL) || buf == NULL)
+	{
+		reference_orbit_free(ref);
+		iteration_buffer_free(buf);
+		palette_free(&pal);
+		RERROR("Error: Could not create TGA data, memory error perhaps.", ERROR_TGA_CREATION);
+	}
+
+	unsigned int const columns = (v->width + opt->tile - 1) / opt->tile;
+	unsigned int const rows = (v->height + opt->tile - 1) / opt->tile;
+	uint64_t const total = (uint64_t) columns * rows;
+	uint64_t done = 0;
+	int error = 0;
+
+	for (unsigned int row = 0; row < rows && !error; row++)
+	{
+		for (unsigned int column = 0; column < columns && !error; column++)
+		{
+			char tile_name[64];
+			snprintf(tile_name, sizeof(tile_name), POSTER_TILE_PATTERN, column, row);
+			snprintf(name, sizeof(name), "%s/%s", dir, tile_name);
+			done++;
+
+			struct stat st;
+			if (stat(name, &st) == 0)
+				continue;
+
+			unsigned int const x0 = column * opt->tile;
+			unsigned int const y0 = row * opt->tile;
+			buf->width = v->width - x0 < opt->tile? v->width - x0 : opt->tile;
+			buf->height = v->height - y0 < opt->tile? v->height - y0 : opt->tile;
+
+			tga_data *tga = tga_create(buf->width, buf->height, 24);
+			if (tga == 0)
+			{
+				puts("Error: Could not create TGA data, memory error perhaps.");
+				error = ERROR_TGA_CREATION;
+				break;
+			}
+
+			render_iterations(v, ref, NULL, x0, y0, buf);
+			colour_iterations(buf, &pal, tga);
+
+			char part[4096 + 8];
+			snprintf(part, sizeof(part), "%s.part", name);
+			f = fopen(part, "wb");
+			if (!f)
+			{
+				puts("Error: Unable to open file for reading.");
+				error = ERROR_FILE_LOCKED;
+			}
+			else
+			{
+				/* A short tile must not be renamed, or resuming would skip it. */
+				tga_write(tga, f);
+				int const write_error = ferror(f);
+				if (fclose(f) != 0 || write_error || rename(part, name) != 0)
+				{
+					remove(part);
+					puts("Error: Unable to write tile.");
+					error = ERROR_TGA_WRITE;
+				}
+			}
+			tga_free(tga);
+
+			fprintf(stderr, "Tile %u, %u done, %llu of %llu.\n", 
+				column, row, (unsigned long long) done, (unsigned long long) total);
+		}
+	}
+
+	reference_orbit_free(ref);
+	iteration_buffer_free(buf);
+	palette_free(&pal);
+
+	return error;
+}
+
+/*
+	TILE SERVICE.
+
+	A long running process that renders map style tiles on request, so
+	a viewer doesn't pay for process startup per image. Tile (z, x, y) 
+	is column x and row y of the 2^z by 2^z grid the view is divided 
+	into at zoom level z. The view itself is tile (0, 0, 0).
+
+	Clients connect to a TCP port on localhost or a UNIX socket and 
+	either send lines of
+
+		z x y [classic|smooth]
+
+	answered by "OK <bytes>" and a TGA, or "ERR <reason>", or an HTTP 
+	request for /z/x/y.tga, optionally with ?smooth.
+
+	Every connection gets a thread. Rendered tiles are kept with their
+	iteration buffers in an LRU cache, so a tile asked for in another 
+	palette is only recoloured. While a tile is being rendered, other 
+	requests for it wait for that render instead of starting their own.
+	Evicted iteration buffers can be spilled to a directory and are 
+	then read back instead of rendered again. Their file names carry a 
+	hash of the view, tile size and iterations, so a service started 
+	with other settings doesn't pick up tiles that aren't its own.
+*/
+#define SERVICE_BUCKETS		4096
+#define SERVICE_MAX_ZOOM	48
+
+typedef struct tile_entry_s
+{
+	int z;
+	uint32_t x;
+	uint32_t y;
+	/* Non-zero while a thread renders the tile, others wait for it. */
+	int rendering;
+	/* Non-zero when the entry is no longer in the cache. */
+	int detached;
+	/* Threads using or waiting for the entry. */
+	int refs;
+	iteration_buffer *buf;
+	/* 
+		The tile as a TGA file per palette, NULL until first asked for. 
+		Once coloured they are never replaced, as other threads may be
+		sending them.
+	*/
+	char *tga[2];
+	size_t tga_len[2];
+	struct tile_entry_s *hash_next;
+	struct tile_entry_s *lru_prev;
+	struct tile_entry_s *lru_next;
+} tile_entry;
+
+typedef struct tile_service_s
+{
+	/* The view covered by tile (0, 0, 0). */
+	view base;
+	unsigned int tile;
+	palette palettes[2];
+	/* Directory evicted iteration buffers are spilled to, or NULL. */
+	char const *spill;
+	/* Hash of the settings the spilled buffers were rendered with. */
+	uint64_t spill_key;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t rendered;
+	tile_entry *buckets[SERVICE_BUCKETS];
+	/* Most recently used first. */
+	tile_entry *lru_head;
+	tile_entry *lru_tail;
+	unsigned int entries;
+	unsigned int capacity;
+} tile_service;
+
+unsigned int tile_hash(int z, uint32_t x, uint32_t y)
+{
+	uint64_t h = ((uint64_t) z * 0x9E3779B97F4A7C15ull) ^ ((uint64_t) x * 0xC2B2AE3D27D4EB4Full) ^ y;
+	return (h ^ (h >> 29)) % SERVICE_BUCKETS;
+}
+
+/*
+	Returns the view of a tile, or 0 if there is no such tile.
+*/
+int tile_view(tile_service const *svc, int z, uint32_t x, uint32_t y, view *tv)
+{
+	if (z < 0 || z > SERVICE_MAX_ZOOM)
+		return 0;
+	uint64_t const n = 1ull << z;
+	if (x >= n || y >= n)
+		return 0;
+
+	*tv = svc->base;
+	tv->width = svc->tile;
+	tv->height = svc->tile;
+	tv->scale = svc->base.scale / n;
+	tv->center_re = svc->base.center_re + ((x + 0.5L) / n - 0.5L) * svc->base.scale;
+	tv->center_im = svc->base.center_im + ((y + 0.5L) / n - 0.5L) * svc->base.scale;
+	return 1;
+}
+
+/*
+	FNV-1a hash of everything that changes the iteration buffer of a 
+	tile. The floats go in through their hex text, which is exact.
+*/
+uint64_t tile_spill_key(tile_service const *svc)
+{
+	char settings[256];
+	snprintf(settings, sizeof(settings), "%La %La %a %d %d %u", svc->base.center_re, svc->base.center_im, 
+		svc->base.scale, svc->base.iterations, svc->base.series, svc->tile);
+
+	uint64_t h = 0xCBF29CE484222325ull;
+	for (char const *c = settings; *c; c++)
+		h = (h ^ (unsigned char) *c) * 0x100000001B3ull;
+	return h;
+}
+
+void tile_spill_name(tile_service const *svc, tile_entry const *e, char *name, size_t size)
+{
+	snprintf(name, size, "%s/%016llx_%d_%u_%u.mbi", svc->spill, (unsigned long long) svc->spill_key, 
+		e->z, e->x, e->y);
+}
+
+void tile_entry_free(tile_entry *e)
+{
+	iteration_buffer_free(e->buf);
+	free(e->tga[0]);
+	free(e->tga[1]);
+	free(e);
+}
+
+/*
+	Removes e from the hash table and the LRU list. Must hold the mutex.
+*/
+void tile_service_detach(tile_service *svc, tile_entry *e)
+{
+	tile_entry **link = &svc->buckets[tile_hash(e->z, e->x, e->y)];
+	while (*link != e)
+		link = &(*link)->hash_next;
+	*link = e->hash_next;
+
+	if (e->lru_prev)
+		e->lru_prev->lru_next = e->lru_next;
+	else
+		svc->lru_head = e->lru_next;
+	if (e->lru_next)
+		e->lru_next->lru_prev = e->lru_prev;
+	else
+		svc->lru_tail = e->lru_prev;
+
+	e->detached = 1;
+	svc->entries--;
+}
+
+/*
+	Moves e to the front of the LRU list, inserting it if it isn't in 
+	it. Must hold the mutex.
+*/
+void tile_service_touch(tile_service *svc, tile_entry *e, int insert)
+{
+	if (!insert)
+	{
+		if (svc->lru_head == e)
+			return;
+		e->lru_prev->lru_next = e->lru_next;
+		if (e->lru_next)
+			e->lru_next->lru_prev = e->lru_prev;
+		else
+			svc->lru_tail = e->lru_prev;
+	}
+
+	e->lru_prev = NULL;
+	e->lru_next = svc->lru_head;
+	if (svc->lru_head)
+		svc->lru_head->lru_prev = e;
+	svc->lru_head = e;
+	if (svc->lru_tail == NULL)
+		svc->lru_tail = e;
+}
+
+/*
+	Evicts least recently used tiles until the cache fits its capacity. 
+	Tiles still in use are passed over. Must hold the mutex; evicted 
+	tiles are returned as a list through hash_next to be spilled and 
+	freed after releasing it.
+*/
+tile_entry *tile_service_evict(tile_service *svc)
+{
+	tile_entry *evicted = NULL;
+	tile_entry *e = svc->lru_tail;
+	while (e != NULL && svc->entries > svc->capacity)
+	{
+		tile_entry *prev = e->lru_prev;
+		if (e->refs == 0 && !e->rendering)
+		{
+			tile_service_detach(svc, e);
+			e->hash_next = evicted;
+			evicted = e;
+		}
+		e = prev;
+	}
+	return evicted;
+}
+
+/*
+	Renders or reads back the iteration buffer of e. Returns 0 on 
+	failure.
+*/
+int tile_service_render(tile_service *svc, tile_entry *e)
+{
+	if (svc->spill != NULL)
+	{
+		char name[4096];
+		tile_spill_name(svc, e, name, sizeof(name));
+		FILE *f = fopen(name, "rb");
+		if (f)
+		{
+			e->buf = iteration_buffer_read(f);
+			fclose(f);
+			if (e->buf != NULL && e->buf->width == svc->tile && e->buf->height == svc->tile 
+			 && e->buf->iterations == (uint32_t) svc->base.iterations)
+				return 1;
+			iteration_buffer_free(e->buf);
+			e->buf = NULL;
+		}
+	}
+
+	view tv;
+	tile_view(svc, e->z, e->x, e->y, &tv);
+
+	e->buf = iteration_buffer_create(tv.width, tv.height, tv.iterations);
+	if (e->buf == NULL)
+		return 0;
+
+	reference_orbit *ref = NULL;
+	if (tv.series)
+	{
+		ref = reference_orbit_create(&tv);
+		if (ref == NULL)
+			return 0;
+	}
+	render_iterations(&tv, ref, NULL, 0, 0, e->buf);
+	reference_orbit_free(ref);
+
+	return 1;
+}
+
+/*
+	Colours the iteration buffer of e into e->tga[pal]. Returns 0 on 
+	failure.
+*/
+int tile_service_colour(tile_service *svc, tile_entry *e, int pal)
+{
+	tga_data *tga = tga_create(e->buf->width, e->buf->height, 24);
+	if (tga == 0)
+		return 0;
+	colour_iterations(e->buf, &svc->palettes[pal], tga);
+
+	char *bytes = NULL;
+	size_t len = 0;
+	FILE *f = open_memstream(&bytes, &len);
+	if (!f)
+	{
+		tga_free(tga);
+		return 0;
+	}
+	tga_write(tga, f);
+	fclose(f);
+	tga_free(tga);
+
+	e->tga[pal] = bytes;
+	e->tga_len[pal] = len;
+	return 1;
+}
+
+/*
+	Drops a reference taken by tile_service_get.
+*/
+void tile_service_release(tile_service *svc, tile_entry *e)
+{
+	pthread_mutex_lock(&svc->mutex);
+	int const dead = --e->refs == 0 && e->detached;
+	pthread_mutex_unlock(&svc->mutex);
+
+	if (dead)
+		tile_entry_free(e);
+}
+
+/*
+	Returns the tile with e->tga[pal] coloured, rendering it if it isn't
+	cached. The entry stays valid until it is released with 
+	tile_service_release.
+
+	Returns NULL on failure.
+*/
+tile_entry *tile_service_get(tile_service *svc, int z, uint32_t x, uint32_t y, int pal)
+{
+	unsigned int const bucket = tile_hash(z, x, y);
+
+	pthread_mutex_lock(&svc->mutex);
+
+	tile_entry *e = svc->buckets[bucket];
+	while (e != NULL && (e->z != z || e->x != x || e->y != y))
+		e = e->hash_next;
+
+	if (e != NULL)
+	{
+		e->refs++;
+		while (e->rendering)
+			pthread_cond_wait(&svc->rendered, &svc->mutex);
+
+		if (e->buf == NULL)
+		{
+			/* The render we waited for failed. */
+			pthread_mutex_unlock(&svc->mutex);
+			tile_service_release(svc, e);
+			return NULL;
+		}
+
+		if (!e->detached)
+			tile_service_touch(svc, e, 0);
+
+		/*
+			Recolouring is cheap next to rendering, so it is done while
+			holding the mutex rather than coordinating it.
+		*/
+		int ok = e->tga[pal] != NULL || tile_service_colour(svc, e, pal);
+		pthread_mutex_unlock(&svc->mutex);
+		if (!ok)
+		{
+			tile_service_release(svc, e);
+			return NULL;
+		}
+		return e;
+	}
+
+	e = calloc(1, sizeof(tile_entry));
+	if (e == NULL)
+	{
+		pthread_mutex_unlock(&svc->mutex);
+		return NULL;
+	}
+	e->z = z;
+	e->x = x;
+	e->y = y;
+	e->rendering = 1;
+	e->refs = 1;
+	e->hash_next = svc->buckets[bucket];
+	svc->buckets[bucket] = e;
+	tile_service_touch(svc, e, 1);
+	svc->entries++;
+
+	tile_entry *evicted = tile_service_evict(svc);
+	pthread_mutex_unlock(&svc->mutex);
+
+	while (evicted != NULL)
+	{
+		tile_entry *next = evicted->hash_next;
+		if (svc->spill != NULL)
+		{
+			/* 
+				Written under a name of its own and renamed, so a thread 
+				reading the tile back never sees half a buffer.
+			*/
+			char name[4096];
+			char part[4096 + 32];
+			tile_spill_name(svc, evicted, name, sizeof(name));
+			snprintf(part, sizeof(part), "%s.%p.part", name, (void *) evicted);
+			FILE *f = fopen(part, "wb");
+			if (f)
+			{
+				int error = iteration_buffer_write(evicted->buf, f);
+				if (fclose(f) != 0 || error || rename(part, name) != 0)
+					remove(part);
+			}
+		}
+		tile_entry_free(evicted);
+		evicted = next;
+	}
+
+	int ok = tile_service_render(svc, e) && tile_service_colour(svc, e, pal);
+
+	pthread_mutex_lock(&svc->mutex);
+	if (!ok)
+	{
+		iteration_buffer_free(e->buf);
+		e->buf = NULL;
+		tile_service_detach(svc, e);
+	}
+	e->rendering = 0;
+	pthread_cond_broadcast(&svc->rendered);
+	pthread_mutex_unlock(&svc->mutex);
+
+	if (!ok)
+	{
+		tile_service_release(svc, e);
+		return NULL;
+	}
+	return e;
+}
+
+/*
+	Writes all of len bytes to fd. Returns 0 on success.
+*/
+int write_all(int fd, void const *data, size_t len)
+{
+	char const *p = data;
+	while (len > 0)
+	{
+		ssize_t n = write(fd, p, len);
+		if (n <= 0)
+			return 1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+typedef struct service_connection_s
+{
+	tile_service *svc;
+	int fd;
+} service_connection;
+
+void *service_connection_worker(void *arg)
+{
+	service_connection conn = *(service_connection *) arg;
+	free(arg);
+
+	FILE *in = fdopen(conn.fd, "r");
+	if (!in)
+	{
+		close(conn.fd);
+		return NULL;
+	}
+
+	char line[1024];
+	while (fgets(line, sizeof(line), in))
+	{
+		int z = -1;
+		unsigned int x = 0, y = 0;
+		int pal = strstr(line, "smooth") != NULL? PALETTE_SMOOTH : PALETTE_CLASSIC;
+		int const http = strncmp(line, "GET ", 4) == 0;
+		int parsed = http?
+			sscanf(line, "GET /%d/%u/%u.tga", &z, &x, &y) == 3 :
+			sscanf(line, "%d %u %u", &z, &x, &y) == 3;
+
+		if (http)
+		{
+			/* Skip the request headers. */
+			char header[1024];
+			while (fgets(header, sizeof(header), in) && strcmp(header, "\r\n") != 0 && strcmp(header, "\n") != 0)
+				;
+		}
+
+		view tv;
+		tile_entry *e = NULL;
+		char const *reason = "Bad request";
+		if (parsed && !tile_view(conn.svc, z, x, y, &tv))
+			reason = "No such tile";
+		else if (parsed)
+		{
+			e = tile_service_get(conn.svc, z, x, y, pal);
+			reason = "Render failed";
+		}
+
+		char head[256];
+		int failed = 0;
+		if (e != NULL)
+		{
+			int len = http?
+				snprintf(head, sizeof(head), 
+					"HTTP/1.0 200 OK\r\nContent-Type: image/x-tga\r\nContent-Length: %zu\r\n\r\n", e->tga_len[pal]) :
+				snprintf(head, sizeof(head), "OK %zu\n", e->tga_len[pal]);
+			failed = write_all(conn.fd, head, len) || write_all(conn.fd, e->tga[pal], e->tga_len[pal]);
+			tile_service_release(conn.svc, e);
+		}
+		else
+		{
+			int len = http?
+				snprintf(head, sizeof(head), 
+					"HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\nContent-Length: %zu\r\n\r\n%s\n", 
+					strlen(reason) + 1, reason) :
+				snprintf(head, sizeof(head), "ERR %s\n", reason);
+			failed = write_all(conn.fd, head, len);
+		}
+
+		if (http || failed)
+			break;
+	}
+
+	fclose(in);
+	return NULL;
+}
+
+/*
+	Listens on addr, a TCP port on localhost or unix:<path>, and serves 
+	tiles until killed.
+*/
+int serve_tiles(view const *v, render_options const *opt, char const *addr, unsigned int capacity, char const *spill)
+{
+	static tile_service svc;
+	svc.base = *v;
+	svc.tile = opt->tile;
+	svc.spill = spill;
+	svc.spill_key = tile_spill_key(&svc);
+	svc.capacity = capacity;
+	pthread_mutex_init(&svc.mutex, NULL);
+	pthread_cond_init(&svc.rendered, NULL);
+
+	if (opt->tile < 2 || opt->tile > 65535)
+		RERROR("Error: Tile size must be between 2 and 65535 pixels.", 
+			    ERROR_DIMENSIONS_TO_SMALL);
+	if (spill != NULL)
+		mkdir(spill, 0777);
+
+	if (!palette_init(&svc.palettes[PALETTE_CLASSIC], PALETTE_CLASSIC, v->iterations, opt->density)
+	 || !palette_init(&svc.palettes[PALETTE_SMOOTH], PALETTE_SMOOTH, v->iterations, opt->density))
+		RERROR("Error: Could not create palette, memory error perhaps.", ERROR_TGA_CREATION);
+
+	int fd = -1;
+	if (strncmp(addr, "unix:", 5) == 0)
+	{
+		struct sockaddr_un sa;
+		memset(&sa, 0, sizeof(sa));
+		sa.sun_family = AF_UNIX;
+		snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", addr + 5);
+		unlink(sa.sun_path);
+
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0 || bind(fd, (struct sockaddr *) &sa, sizeof(sa)) != 0)
+			RERROR("Error: Unable to bind socket.", ERROR_FILE_LOCKED);
+	}
+	else
+	{
+		struct sockaddr_in sa;
+		memset(&sa, 0, sizeof(sa));
+		sa.sin_family = AF_INET;
+		sa.sin_port = htons(atoi(addr));
+		sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+		int yes = 1;
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd >= 0)
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+		if (fd < 0 || bind(fd, (struct sockaddr *) &sa, sizeof(sa)) != 0)
+			RERROR("Error: Unable to bind socket.", ERROR_FILE_LOCKED);
+	}
+	if (listen(fd, 64) != 0)
+		RERROR("Error: Unable to listen on socket.", ERROR_FILE_LOCKED);
+
+	/* Clients hanging up mid tile shouldn't kill us. */
+	signal(SIGPIPE, SIG_IGN);
+
+	fprintf(stderr, "Serving %ux%u tiles on %s.\n", opt->tile, opt->tile, addr);
+
+	while (1)
+	{
+		int client = accept(fd, NULL, NULL);
+		if (client < 0)
+			continue;
+
+		service_connection *conn = malloc(sizeof(service_connection));
+		pthread_t thread;
+		if (conn == NULL)
+		{
+			close(client);
+			continue;
+		}
+		conn->svc = &svc;
+		conn->fd = client;
+		if (pthread_create(&thread, NULL, service_connection_worker, conn) != 0)
+		{
+			free(conn);
+			close(client);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+
+	return 0;
+}
+
+void print_usage(void)
+{
+	puts("mandelbrot [-w width] [-h height] [-c re im] [-s scale] [-i iterations] [-nosa]"
+	     "\n           [-frames n] [-zoom factor] [-reuse] [-palette classic|smooth]"
+	     "\n           [-density d] [-save file] [-load file] [-tile size] [-o file]"
+	     "\n           [-serve port|unix:path] [-cache tiles] [-spill dir]"
+	     "\n\n\tRenders the Mandelbrot set to a 24-bit TGA, mandelbrot.tga by default."
+	     "\n\tThe scale is how much of the complex plane the shortest side spans."
+	     "\n\t-nosa disables the series approximation used for deep zooms."
+	     "\n\n\t-frames renders a zoom sequence towards the center, each frame scaled"
+	     "\n\tby -zoom (0.5 by default). The file name is then a printf pattern for"
+	     "\n\tthe frame number, mandelbrot_%04d.tga by default, or - for stdout."
+	     "\n\t-reuse guesses pixels from the previous frame where it is flat, which"
+	     "\n\tis faster but can lose details thinner than a pixel."
+	     "\n\n\t-palette smooth colours by normalised iteration count, -density is"
+	     "\n\tthe number of palette entries per iteration (16 by default)."
+	     "\n\t-save writes the iteration buffer of each frame next to the picture,"
+	     "\n\t-load colours a saved buffer without rendering."
+	     "\n\n\t-tile renders a poster as a grid of tiles of the given size into the"
+	     "\n\tdirectory given by -o, mandelbrot_poster by default. Running the"
+	     "\n\tsame command again resumes an interrupted poster."
+	     "\n\n\t-serve renders z/x/y tiles (256 pixels unless -tile is given) of the"
+	     "\n\tview on request. -cache is the number of tiles kept in memory, 1024 by"
+	     "\n\tdefault, -spill a directory for tiles evicted from it.");
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long w = 1920;
+	unsigned long h = 1080;
+	unsigned long mult = 1;
+
+	view v;
+	v.center_re = -0.5L;
+	v.center_im = 0.0L;
+	v.scale = 2.5;
+	v.iterations = 500;
+	v.series = 1;
+
+	render_options opt;
+	opt.frames = 1;
+	opt.zoom = 0.5;
+	opt.reuse = 0;
+	opt.palette = PALETTE_CLASSIC;
+	opt.density = 16.0f;
+	opt.filename = NULL;
+	opt.save = NULL;
+	opt.tile = 0;
+
+	char const *load = NULL;
+	char const *serve = NULL;
+	char const *spill = NULL;
+	unsigned int cache = 1024;
+
+	for (int a = 1; a < argc; a++)
+	{
+		if (strcmp(argv[a], "-w") == 0 && a + 1 < argc)
+			w = strtoul(argv[++a], NULL, 10);
+		else if (strcmp(argv[a], "-h") == 0 && a + 1 < argc)
+			h = strtoul(argv[++a], NULL, 10);
+		else if (strcmp(argv[a], "-c") == 0 && a + 2 < argc)
+		{
+			v.center_re = strtold(argv[++a], NULL);
+			v.center_im = strtold(argv[++a], NULL);
+		}
+		else if (strcmp(argv[a], "-s") == 0 && a + 1 < argc)
+			v.scale = atof(argv[++a]);
+		else if (strcmp(argv[a], "-i") == 0 && a + 1 < argc)
+			v.iterations = atoi(argv[++a]);
+		else if (strcmp(argv[a], "-nosa") == 0)
+			v.series = 0;
+		else if (strcmp(argv[a], "-frames") == 0 && a + 1 < argc)
+			opt.frames = atoi(argv[++a]);
+		else if (strcmp(argv[a], "-zoom") == 0 && a + 1 < argc)
+			opt.zoom = atof(argv[++a]);
+		else if (strcmp(argv[a], "-reuse") == 0)
+			opt.reuse = 1;
+		else if (strcmp(argv[a], "-palette") == 0 && a + 1 < argc)
+		{
+			a++;
+			if (strcmp(argv[a], "classic") == 0)
+				opt.palette = PALETTE_CLASSIC;
+			else if (strcmp(argv[a], "smooth") == 0)
+				opt.palette = PALETTE_SMOOTH;
+			else
+			{
+				print_usage();
+				return 1;
+			}
+		}
+		else if (strcmp(argv[a], "-density") == 0 && a + 1 < argc)
+			opt.density = atof(argv[++a]);
+		else if (strcmp(argv[a], "-save") == 0 && a + 1 < argc)
+			opt.save = argv[++a];
+		else if (strcmp(argv[a], "-load") == 0 && a + 1 < argc)
+			load = argv[++a];
+		else if (strcmp(argv[a], "-tile") == 0 && a + 1 < argc)
+			opt.tile = strtoul(argv[++a], NULL, 10);
+		else if (strcmp(argv[a], "-serve") == 0 && a + 1 < argc)
+			serve = argv[++a];
+		else if (strcmp(argv[a], "-cache") == 0 && a + 1 < argc)
+			cache = strtoul(argv[++a], NULL, 10);
+		else if (strcmp(argv[a], "-spill") == 0 && a + 1 < argc)
+			spill = argv[++a];
+		else if (strcmp(argv[a], "-o") == 0 && a + 1 < argc)
+			opt.filename = argv[++a];
+		else
+		{
+			print_usage();
+			return 1;
+		}
+	}
+
+	if (opt.filename == NULL && opt.tile > 0)
+		opt.filename = "mandelbrot_poster";
+	else if (opt.filename == NULL)
+		opt.filename = opt.frames > 1? "mandelbrot_%04d.tga" : "mandelbrot.tga";
+
+	if (v.iterations < 1 || v.scale <= 0.0 || opt.frames < 1 || opt.zoom <= 0.0 || opt.density <= 0.0f)
+	{
+		print_usage();
+		return 1;
+	}
+	if (opt.frames > 1 && ((strcmp(opt.filename, "-") != 0 && !frame_pattern_valid(opt.filename))
+	 || (opt.save != NULL && !frame_pattern_valid(opt.save))))
+	{
+		fputs("Error: With -frames, -o and -save need one integer conversion such as %04d.\n", stderr);
+		return 1;
+	}
+	/* Guessing only works when every frame lies inside the one before. */
+	if (opt.zoom >= 1.0)
+		opt.reuse = 0;
+
+	if (serve != NULL)
+	{
+		if (opt.tile == 0)
+			opt.tile = 256;
+		return serve_tiles(&v, &opt, serve, cache, spill);
+	}
+
+	if (load != NULL)
+	{
+		opt.frames = 1;
+		return recolour_picture(load, &opt);
+	}
+
+	if (w * mult > UINT32_MAX || h * mult > UINT32_MAX)
+	{
+		print_usage();
+		return 1;
+	}
+	v.width = w*mult;
+	v.height = h*mult;
+
+	if (opt.tile > 0)
+		return draw_poster(&v, &opt);
+
+	/* A single TGA can't be larger than this. */
+	if (v.width > 65535 || v.height > 65535)
+		RERROR("Error: Pictures larger than 65535 pixels need -tile.", ERROR_DIMENSIONS_TO_SMALL);
+
+	return draw_picture(&v, &opt);
+}
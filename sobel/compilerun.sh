@@ -1,3 +1,3 @@
-cc -O2 -Wall -std=c99 sobel.c tga.c -o sobel
+cc -O2 -march=native -Wall -std=c99 sobel.c tga.c -o sobel -lm -pthread
 cat mandrill_24bpp.tga | sobel > sobel_out.tga
 rm sobel sobel.exe
\ No newline at end of file
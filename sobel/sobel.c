@@ -1,10 +1,907 @@
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "math.h"
 #include "stdio.h"
 #include "stdlib.h"
+#include "string.h"
 #include "tga.h"
 
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
 #ifdef _WIN32
 #include <fcntl.h>
 #include <io.h>
+#else
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+/*
+	Scanlines processed at a time when streaming.
+*/
+#define SOBEL_BAND_ROWS		64
+/*
+	Fewest scanlines worth handing to a thread of their own.
+*/
+#define SOBEL_THREAD_ROWS	16
+#define SOBEL_MAX_THREADS	64
+
+typedef enum sobel_mode_e
+{
+	/* Swaps the blue and red channels, the TGA-lib test. */
+	SOBEL_SWAP,
+	/* Gradient magnitude of the luma, as a grey image. */
+	SOBEL_LUMA,
+	/* Gradient magnitude of each colour channel on its own. */
+	SOBEL_CHANNELS,
+	/* Luma gradient magnitude coloured by the gradient direction. */
+	SOBEL_DIRECTION
+} sobel_mode;
+
+/*
+	Hue for each of the 256 gradient directions, BGR.
+*/
+static uint8_t sobel_hue[256][3];
+
+/*
+	SOBEL OPERATOR.
+
+	The 3x3 Sobel kernels are separable:
+
+		Gx = [1 2 1]^T * [-1 0 1]
+		Gy = [-1 0 1]^T * [1 2 1]
+
+	So every scanline is done in two passes. The vertical pass combines
+	the rows above, at and below it into a smoothed row s and a 
+	differenced row d, the horizontal pass then gives
+
+		gx = s[x + 1] - s[x - 1]
+		gy = d[x - 1] + 2 d[x] + d[x + 1]
+
+	Both fit in 16 bits. The magnitude is sqrt(gx^2 + gy^2) / 4, so a full 
+	contrast step edge comes out as 255. Edges are extended, pixels 
+	outside the image repeat the nearest one.
+*/
+
+/*
+	A band of output scanlines to compute. src holds src_rows scanlines 
+	of input, dst gets count scanlines, the first of which is the 
+	operator applied around src scanline first. The scanlines of each
+	are the given stride bytes apart. Neighbours above the 
+	first and below the last src scanline are clamped.
+
+	Scanlines are taken in the order they are stored. The magnitude 
+	doesn't care, the direction does, bottom_up says which way round 
+	they are.
+*/
+typedef struct sobel_job_s
+{
+	uint8_t const *src;
+	uint64_t src_stride;
+	uint32_t src_rows;
+	uint8_t *dst;
+	uint64_t dst_stride;
+	uint32_t first;
+	uint32_t count;
+	uint16_t width;
+	uint8_t bitdepth;
+	sobel_mode mode;
+	int bottom_up;
+} sobel_job;
+
+typedef struct sobel_part_s
+{
+	sobel_job const *job;
+	uint32_t y0;
+	uint32_t y1;
+	int error;
+} sobel_part;
+
+void sobel_init_hues(void)
+{
+	for (int i = 0; i < 256; ++i)
+	{
+		float h = i * 6.0f / 256.0f;
+		int sector = (int) h;
+		float f = h - sector;
+		uint8_t up = (uint8_t) lrintf(f * 255.0f);
+		uint8_t down = 255 - up;
+		uint8_t rgb[6][3] = {
+			{ 255, up, 0 }, { down, 255, 0 }, { 0, 255, up },
+			{ 0, down, 255 }, { up, 0, 255 }, { 255, 0, down }
+		};
+		sobel_hue[i][0] = rgb[sector][2];
+		sobel_hue[i][1] = rgb[sector][1];
+		sobel_hue[i][2] = rgb[sector][0];
+	}
+}
+
+/*
+	Extracts one plane of a scanline, channel 0 to 2 or the luma when
+	channel is -1.
+*/
+static void sobel_load_plane(uint8_t const *row, uint16_t width, uint8_t bitdepth, int channel, uint8_t *plane)
+{
+	uint32_t bpp = bitdepth / 8;
+	if (channel < 0)
+	{
+		for (uint32_t x = 0; x < width; ++x, row += bpp)
+			plane[x] = (uint8_t) ((29 * row[0] + 150 * row[1] + 77 * row[2] + 128) >> 8);
+	}
+	else
+	{
+		for (uint32_t x = 0; x < width; ++x, row += bpp)
+			plane[x] = row[channel];
+	}
+}
+
+/*
+	Vertical pass. s and d get one element of padding on either side,
+	filled in with the edge values.
+*/
+static void sobel_vertical(uint8_t const *a, uint8_t const *b, uint8_t const *c, uint16_t width, int16_t *s, int16_t *d)
+{
+	uint32_t x = 0;
+#ifdef __AVX2__
+	for (; x + 16 <= width; x += 16)
+	{
+		__m256i va = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i const *) (a + x)));
+		__m256i vb = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i const *) (b + x)));
+		__m256i vc = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i const *) (c + x)));
+		__m256i vs = _mm256_add_epi16(_mm256_add_epi16(va, vc), _mm256_slli_epi16(vb, 1));
+		_mm256_storeu_si256((__m256i *) (s + 1 + x), vs);
+		_mm256_storeu_si256((__m256i *) (d + 1 + x), _mm256_sub_epi16(vc, va));
+	}
+#endif
+	for (; x < width; ++x)
+	{
+		s[1 + x] = (int16_t) (a[x] + 2 * b[x] + c[x]);
+		d[1 + x] = (int16_t) (c[x] - a[x]);
+	}
+	s[0] = s[1];
+	d[0] = d[1];
+	s[width + 1] = s[width];
+	d[width + 1] = d[width];
+}
+
+/*
+	Horizontal pass, gives the magnitude of every pixel in the scanline
+	and, if dir isn't NULL, the direction as 256ths of a turn. flip
+	negates gy for the direction, for scanlines stored bottom up.
+*/
+static void sobel_horizontal(int16_t const *s, int16_t const *d, uint16_t width, uint8_t *mag, uint8_t *dir, int flip)
+{
+	uint32_t x = 0;
+#ifdef __AVX2__
+	__m256 const quarter = _mm256_set1_ps(0.25f);
+	for (; x + 16 <= width; x += 16)
+	{
+		__m256i sl = _mm256_loadu_si256((__m256i const *) (s + x));
+		__m256i sr = _mm256_loadu_si256((__m256i const *) (s + x + 2));
+		__m256i dl = _mm256_loadu_si256((__m256i const *) (d + x));
+		__m256i dc = _mm256_loadu_si256((__m256i const *) (d + x + 1));
+		__m256i dr = _mm256_loadu_si256((__m256i const *) (d + x + 2));
+		__m256i gx = _mm256_sub_epi16(sr, sl);
+		__m256i gy = _mm256_add_epi16(_mm256_add_epi16(dl, dr), _mm256_slli_epi16(dc, 1));
+
+		/* gx^2 + gy^2 in 32 bits, pixels 0-3 and 8-11 in lo, the rest in hi. */
+		__m256i lo = _mm256_unpacklo_epi16(gx, gy);
+		__m256i hi = _mm256_unpackhi_epi16(gx, gy);
+		lo = _mm256_madd_epi16(lo, lo);
+		hi = _mm256_madd_epi16(hi, hi);
+		lo = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_sqrt_ps(_mm256_cvtepi32_ps(lo)), quarter));
+		hi = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_sqrt_ps(_mm256_cvtepi32_ps(hi)), quarter));
+
+		/* Packing undoes the interleaving within each lane. */
+		__m256i m = _mm256_packus_epi16(_mm256_packs_epi32(lo, hi), _mm256_setzero_si256());
+		m = _mm256_permute4x64_epi64(m, _MM_SHUFFLE(3, 1, 2, 0));
+		_mm_storeu_si128((__m128i *) (mag + x), _mm256_castsi256_si128(m));
+	}
+#endif
+	for (; x < width; ++x)
+	{
+		int32_t gx = s[x + 2] - s[x];
+		int32_t gy = d[x] + 2 * d[x + 1] + d[x + 2];
+		long m = lrintf(sqrtf((float) (gx * gx + gy * gy)) * 0.25f);
+		mag[x] = (uint8_t) (m > 255? 255 : m);
+	}
+
+	if (dir == NULL)
+		return;
+
+	for (x = 0; x < width; ++x)
+	{
+		int32_t gx = s[x + 2] - s[x];
+		int32_t gy = d[x] + 2 * d[x + 1] + d[x + 2];
+		if (flip)
+			gy = -gy;
+		float turns = atan2f((float) gy, (float) gx) * (0.5f / 3.14159265f);
+		dir[x] = (uint8_t) ((int32_t) lrintf(turns * 256.0f) & 0xFF);
+	}
+}
+
+/*
+	Computes scanlines y0 to y1 of a job. The planes of the three input
+	scanlines in use are kept in a rolling buffer, so each is only 
+	extracted once.
+*/
+static void *sobel_worker(void *arg)
+{
+	sobel_part *part = arg;
+	sobel_job const *job = part->job;
+	uint32_t const width = job->width;
+	uint32_t const bpp = job->bitdepth / 8;
+	int const planes = job->mode == SOBEL_CHANNELS? 3 : 1;
+
+	uint8_t *plane = malloc((size_t) planes * 3 * width);
+	int16_t *sd = malloc(2 * ((size_t) width + 2) * sizeof(int16_t));
+	uint8_t *mag = malloc(2 * (size_t) width);
+	if (plane == NULL || sd == NULL || mag == NULL)
+	{
+		part->error = 1;
+		free(plane);
+		free(sd);
+		free(mag);
+		return NULL;
+	}
+	int16_t *s = sd;
+	int16_t *d = sd + width + 2;
+	uint8_t *dir = job->mode == SOBEL_DIRECTION? mag + width : NULL;
+
+	/* Which source scanline each slot of the rolling buffer holds. */
+	int64_t loaded[3] = { -1, -1, -1 };
+
+	for (uint32_t y = part->y0; y < part->y1; ++y)
+	{
+		uint32_t centre = job->first + y;
+		uint32_t rows[3] = {
+			centre > 0? centre - 1 : 0,
+			centre,
+			centre + 1 < job->src_rows? centre + 1 : centre
+		};
+		for (int i = 0; i < 3; ++i)
+		{
+			uint32_t slot = rows[i] % 3;
+			if (loaded[slot] == rows[i])
+				continue;
+			for (int p = 0; p < planes; ++p)
+				sobel_load_plane(job->src + job->src_stride * rows[i], job->width, job->bitdepth, 
+					planes == 1? -1 : p, plane + ((size_t) p * 3 + slot) * width);
+			loaded[slot] = rows[i];
+		}
+
+		uint8_t const *in = job->src + job->src_stride * centre;
+		uint8_t *out = job->dst + job->dst_stride * y;
+		for (int p = 0; p < planes; ++p)
+		{
+			uint8_t const *base = plane + (size_t) p * 3 * width;
+			sobel_vertical(base + (rows[0] % 3) * width, base + (rows[1] % 3) * width, 
+				base + (rows[2] % 3) * width, job->width, s, d);
+			sobel_horizontal(s, d, job->width, mag, dir, job->bottom_up);
+
+			if (job->mode == SOBEL_CHANNELS)
+			{
+				for (uint32_t x = 0; x < width; ++x)
+					out[x * bpp + p] = mag[x];
+			}
+			else if (job->mode == SOBEL_DIRECTION)
+			{
+				for (uint32_t x = 0; x < width; ++x)
+				{
+					uint8_t const *hue = sobel_hue[dir[x]];
+					out[x * bpp + 0] = (uint8_t) ((hue[0] * mag[x] + 127) / 255);
+					out[x * bpp + 1] = (uint8_t) ((hue[1] * mag[x] + 127) / 255);
+					out[x * bpp + 2] = (uint8_t) ((hue[2] * mag[x] + 127) / 255);
+				}
+			}
+			else
+			{
+				for (uint32_t x = 0; x < width; ++x)
+					out[x * bpp + 0] = out[x * bpp + 1] = out[x * bpp + 2] = mag[x];
+			}
+		}
+
+		/* Alpha is kept as is. */
+		if (bpp == 4)
+		{
+			for (uint32_t x = 0; x < width; ++x)
+				out[x * 4 + 3] = in[x * 4 + 3];
+		}
+	}
+
+	free(plane);
+	free(sd);
+	free(mag);
+	return NULL;
+}
+
+/*
+	Number of processors online, at most SOBEL_MAX_THREADS.
+*/
+uint32_t sobel_cpus(void)
+{
+#ifndef _WIN32
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus > SOBEL_MAX_THREADS)
+		return SOBEL_MAX_THREADS;
+	return cpus > 1? (uint32_t) cpus : 1;
+#else
+	return 1;
+#endif
+}
+
+/*
+	Runs a job, split into bands of scanlines over nthreads threads, or
+	as many as there are processors if nthreads is 0.
+
+	Returns 0 on success, -1 when out of memory.
+*/
+int sobel_run(sobel_job const *job, uint32_t nthreads)
+{
+	sobel_part parts[SOBEL_MAX_THREADS];
+	if (nthreads == 0)
+		nthreads = sobel_cpus();
+	if (nthreads > SOBEL_MAX_THREADS)
+		nthreads = SOBEL_MAX_THREADS;
+#ifdef _WIN32
+	nthreads = 1;
+#endif
+	if (nthreads > job->count / SOBEL_THREAD_ROWS)
+		nthreads = job->count / SOBEL_THREAD_ROWS > 0? job->count / SOBEL_THREAD_ROWS : 1;
+
+	for (uint32_t i = 0; i < nthreads; ++i)
+	{
+		parts[i].job = job;
+		parts[i].y0 = (uint32_t) ((uint64_t) job->count * i / nthreads);
+		parts[i].y1 = (uint32_t) ((uint64_t) job->count * (i + 1) / nthreads);
+		parts[i].error = 0;
+	}
+
+#ifndef _WIN32
+	pthread_t threads[SOBEL_MAX_THREADS];
+	int started[SOBEL_MAX_THREADS];
+	for (uint32_t i = 1; i < nthreads; ++i)
+		started[i] = pthread_create(&threads[i], NULL, sobel_worker, &parts[i]) == 0;
+	sobel_worker(&parts[0]);
+	for (uint32_t i = 1; i < nthreads; ++i)
+	{
+		/* Bands whose thread couldn't be started are done here. */
+		if (started[i])
+			pthread_join(threads[i], NULL);
+		else
+			sobel_worker(&parts[i]);
+	}
+#else
+	for (uint32_t i = 0; i < nthreads; ++i)
+		sobel_worker(&parts[i]);
+#endif
+
+	for (uint32_t i = 0; i < nthreads; ++i)
+	{
+		if (parts[i].error)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+	Processes a mapped file as a whole.
+*/
+int process_file(char const *filename, sobel_mode mode, int rle)
+{
+	tga_read_result tga_res = tga_map(filename, TGA_PIXELS_MAX);
+	if (!TGA_READ_IS_SUCCESS(tga_res))
+	{
+		puts(tga_res.msg);
+		return tga_res.error;
+	}
+
+	tga_data *tga = tga_res.data;
+	tga_data *out = tga;
+
+	if (mode == SOBEL_SWAP)
+		tga_swap_rb(tga, tga);
+	else
+	{
+		sobel_job job = { tga->data, tga_calc_stride(tga), tga->height, NULL, 0, 0, tga->height, 
+			tga->width, tga->bitdepth, mode, tga->stride < 0 };
+		out = tga_create(tga->width, tga->height, tga->bitdepth);
+		if (out != NULL)
+		{
+			/* Stored the same way round as the input. */
+			if (tga->stride < 0)
+				out->stride = -out->stride;
+			job.dst = out->data;
+			job.dst_stride = tga_calc_stride(out);
+			if (sobel_run(&job, 0) != 0)
+			{
+				tga_free(out);
+				out = NULL;
+			}
+		}
+		if (out == NULL)
+		{
+			puts("Out of memory.");
+			tga_unmap(tga);
+			return TGA_ERROR_READ_OOM;
+		}
+	}
+
+	int write_error;
+	if (rle)
+	{
+		tga_write_rle(out, stdout);
+		write_error = fflush(stdout) != 0 || ferror(stdout);
+	}
+	else
+	{
+#ifdef _WIN32
+		tga_write(out, stdout);
+		write_error = fflush(stdout) != 0 || ferror(stdout);
+#else
+		write_error = tga_write_fd(out, STDOUT_FILENO) != 0;
+#endif
+	}
+	if (write_error)
+		puts("Could not write image.");
+
+	/*
+		Spliced pages may still sit in the pipe waiting for the reader, so
+		they aren't freed or reused here but go with the process, which 
+		ends after this file.
+	*/
+#if defined(TGA_USE_VMSPLICE) && !defined(_WIN32)
+	int const spliced = !rle && !write_error;
+#else
+	int const spliced = 0;
+#endif
+	if (!spliced)
+	{
+		if (out != tga)
+			tga_free(out);
+		tga_unmap(tga);
+	}
+
+	return write_error? 1 : 0;
+}
+
+/*
+	Processes stdin in bands of scanlines, writing each band out before
+	reading the next.
+*/
+int process_stream(int rle)
+{
+	tga_stream in, out;
+	tga_read_result tga_res = tga_read_open(&in, stdin, TGA_BYTES_MAX, TGA_PIXELS_MAX);
+	if (!TGA_READ_IS_SUCCESS(tga_res))
+	{
+		puts(tga_res.msg);
+		return tga_res.error;
+	}
+	if (in.descriptor & TGA_IMAGE_DESCRIPTOR_INTERLEAVING_FLAG)
+	{
+		puts("Interleaved images can't be streamed, pass the file name instead.");
+		tga_read_close(&in);
+		return 1;
+	}
+
+	uint8_t *band = malloc(tga_len(in.width, SOBEL_BAND_ROWS, in.bitdepth));
+	int const top_down = (in.descriptor & TGA_IMAGE_DESCRIPTOR_SCREEN_ORIGIN_BIT_MASK) != 0;
+	if (band == NULL || tga_write_open(&out, stdout, in.width, in.height, in.bitdepth, top_down, rle) != 0)
+	{
+		puts("Could not start writing image.");
+		free(band);
+		return TGA_ERROR_READ_OOM;
+	}
+
+	uint16_t status = TGA_READ_SUCCESS;
+	int write_error = 0;
+	while (in.row < in.height)
+	{
+		uint32_t n = in.height - in.row < SOBEL_BAND_ROWS? in.height - in.row : SOBEL_BAND_ROWS;
+		if ((status = tga_read_rows(&in, band, n)) != TGA_READ_SUCCESS)
+			break;
+
+		tga_data rows = { in.width, (uint16_t) n, band, in.bitdepth, (int64_t) in.width * (in.bitdepth / 8) };
+		tga_swap_rb(&rows, &rows);
+
+		if (tga_write_rows(&out, band, n) != 0)
+		{
+			write_error = 1;
+			break;
+		}
+	}
+
+	tga_read_close(&in);
+	write_error |= tga_write_close(&out) != 0;
+	if (status != TGA_READ_SUCCESS)
+		puts("Could not read image.");
+	else if (write_error)
+		puts("Could not write image.");
+	free(band);
+
+	if (status != TGA_READ_SUCCESS)
+		return status;
+	return write_error? 1 : 0;
+}
+
+/*
+	Runs the Sobel operator over stdin in bands of scanlines. The 
+	operator needs the scanline below each one it computes, so the input
+	is kept one scanline ahead of the output, and the last two scanlines
+	of each band stay in the window for the next.
+*/
+int process_stream_sobel(sobel_mode mode, int rle)
+{
+	tga_stream in, out;
+	tga_read_result tga_res = tga_read_open(&in, stdin, TGA_BYTES_MAX, TGA_PIXELS_MAX);
+	if (!TGA_READ_IS_SUCCESS(tga_res))
+	{
+		puts(tga_res.msg);
+		return tga_res.error;
+	}
+	if (in.descriptor & TGA_IMAGE_DESCRIPTOR_INTERLEAVING_FLAG)
+	{
+		puts("Interleaved images can't be streamed, pass the file name instead.");
+		tga_read_close(&in);
+		return 1;
+	}
+
+	uint64_t const stride = (uint64_t) in.width * (in.bitdepth / 8);
+	uint32_t const capacity = SOBEL_BAND_ROWS + 2;
+	uint8_t *window = malloc(tga_len(in.width, capacity, in.bitdepth));
+	uint8_t *band = malloc(tga_len(in.width, capacity, in.bitdepth));
+	int const top_down = (in.descriptor & TGA_IMAGE_DESCRIPTOR_SCREEN_ORIGIN_BIT_MASK) != 0;
+	if (window == NULL || band == NULL || tga_write_open(&out, stdout, in.width, in.height, in.bitdepth, top_down, rle) != 0)
+	{
+		puts("Could not start writing image.");
+		free(window);
+		free(band);
+		return TGA_ERROR_READ_OOM;
+	}
+
+	uint16_t status = TGA_READ_SUCCESS;
+	int write_error = 0;
+	/* Scanlines in the window, and the first of them still to be computed. */
+	uint32_t have = 0;
+	uint32_t first = 0;
+	while (in.row < in.height)
+	{
+		uint32_t n = in.height - in.row < capacity - have? in.height - in.row : capacity - have;
+		if ((status = tga_read_rows(&in, window + stride * have, n)) != TGA_READ_SUCCESS)
+			break;
+		have += n;
+
+		int const last = in.row == in.height;
+		uint32_t end = last? have : have - 1;
+		sobel_job job = { window, stride, have, band, stride, first, end - first, in.width, in.bitdepth, mode, !top_down };
+		if (sobel_run(&job, 0) != 0)
+		{
+			status = TGA_ERROR_READ_OOM;
+			break;
+		}
+		if (tga_write_rows(&out, band, end - first) != 0)
+		{
+			write_error = 1;
+			break;
+		}
+
+		if (!last)
+		{
+			memmove(window, window + stride * (have - 2), 2 * stride);
+			have = 2;
+			first = 1;
+		}
+	}
+
+	tga_read_close(&in);
+	write_error |= tga_write_close(&out) != 0;
+	if (status != TGA_READ_SUCCESS)
+		puts("Could not read image.");
+	else if (write_error)
+		puts("Could not write image.");
+	free(window);
+	free(band);
+
+	if (status != TGA_READ_SUCCESS)
+		return status;
+	return write_error? 1 : 0;
+}
+
+#ifndef _WIN32
+
+/*
+	BATCH MODE.
+
+	Filters many files with a fixed pool of workers, instead of one 
+	process per file. Each worker takes the next file, maps it, filters
+	it into an output image it keeps from file to file and writes that 
+	out. With the workers at different stages of their files, reading,
+	computing and writing overlap. The kernel is asked to read ahead the
+	file after the one just taken.
+*/
+
+typedef struct batch_s
+{
+	char **paths;
+	uint32_t count;
+	char const *outdir;
+	sobel_mode mode;
+	int rle;
+
+	pthread_mutex_t mutex;
+	uint32_t next;
+	uint32_t failed;
+	/* Seconds spent in each stage, summed over the workers. */
+	double read_time;
+	double compute_time;
+	double write_time;
+} batch;
+
+static double batch_seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void batch_prefetch(char const *path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return;
+	posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+	close(fd);
+}
+
+/*
+	Writes img to the output directory, under the file name of path.
+	Returns 0 on success.
+*/
+static int batch_write(batch const *b, tga_data *img, char const *path)
+{
+	char const *name = strrchr(path, '/');
+	name = name? name + 1 : path;
+
+	char out[PATH_MAX];
+	if (snprintf(out, sizeof(out), "%s/%s", b->outdir, name) >= (int) sizeof(out))
+		return -1;
+
+	if (b->rle)
+	{
+		FILE *f = fopen(out, "wb");
+		if (f == NULL)
+			return -1;
+		tga_write_rle(img, f);
+		int error = ferror(f);
+		return (fclose(f) != 0 || error)? -1 : 0;
+	}
+
+	int fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0)
+		return -1;
+	int error = tga_write_fd(img, fd);
+	return (close(fd) != 0 || error)? -1 : 0;
+}
+
+static void *batch_worker(void *arg)
+{
+	batch *b = arg;
+	tga_data *out = NULL;
+	double read_time = 0, compute_time = 0, write_time = 0;
+	uint32_t failed = 0;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&b->mutex);
+		uint32_t i = b->next < b->count? b->next++ : b->count;
+		pthread_mutex_unlock(&b->mutex);
+		if (i == b->count)
+			break;
+		if (i + 1 < b->count)
+			batch_prefetch(b->paths[i + 1]);
+
+		double t0 = batch_seconds();
+		tga_read_result res = tga_map(b->paths[i], TGA_PIXELS_MAX);
+		double t1 = batch_seconds();
+		read_time += t1 - t0;
+		if (!TGA_READ_IS_SUCCESS(res))
+		{
+			printf("%s: %s\n", b->paths[i], res.msg);
+			failed++;
+			continue;
+		}
+
+		/* The output image is only made anew when the size changes. */
+		tga_data *in = res.data;
+		if (out == NULL || out->width != in->width || out->height != in->height || out->bitdepth != in->bitdepth)
+		{
+			tga_free(out);
+			out = tga_create(in->width, in->height, in->bitdepth);
+		}
+
+		int error = out == NULL;
+		if (!error)
+		{
+			/* Stored the same way round as the input. */
+			if ((out->stride < 0) != (in->stride < 0))
+				out->stride = -out->stride;
+
+			if (b->mode == SOBEL_SWAP)
+				error = tga_swap_rb(out, in) != 0;
+			else
+			{
+				sobel_job job = { in->data, tga_calc_stride(in), in->height, out->data, tga_calc_stride(out), 
+					0, in->height, in->width, in->bitdepth, b->mode, in->stride < 0 };
+				error = sobel_run(&job, 1) != 0;
+			}
+		}
+		tga_unmap(in);
+		double t2 = batch_seconds();
+		compute_time += t2 - t1;
+
+		if (!error)
+			error = batch_write(b, out, b->paths[i]);
+		write_time += batch_seconds() - t2;
+
+		if (error)
+		{
+			printf("%s: Could not process image.\n", b->paths[i]);
+			failed++;
+		}
+	}
+
+	tga_free(out);
+
+	pthread_mutex_lock(&b->mutex);
+	b->failed += failed;
+	b->read_time += read_time;
+	b->compute_time += compute_time;
+	b->write_time += write_time;
+	pthread_mutex_unlock(&b->mutex);
+	return NULL;
+}
+
+static int batch_compare(void const *a, void const *b)
+{
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+static int batch_add(batch *b, uint32_t *capacity, char const *dir, char const *name)
+{
+	if (b->count == *capacity)
+	{
+		uint32_t grown = *capacity? *capacity * 2 : 256;
+		char **paths = realloc(b->paths, grown * sizeof(char *));
+		if (paths == NULL)
+			return -1;
+		b->paths = paths;
+		*capacity = grown;
+	}
+
+	size_t length = (dir? strlen(dir) + 1 : 0) + strlen(name) + 1;
+	char *path = malloc(length);
+	if (path == NULL)
+		return -1;
+	if (dir)
+		snprintf(path, length, "%s/%s", dir, name);
+	else
+		snprintf(path, length, "%s", name);
+	b->paths[b->count++] = path;
+	return 0;
+}
+
+/*
+	Fills in the files of a batch, the .tga files in source if it is a 
+	directory, in name order, otherwise the lines of the list in source,
+	stdin if it is "-".
+
+	Returns 0 on success.
+*/
+static int batch_list(batch *b, char const *source)
+{
+	uint32_t capacity = 0;
+	struct stat st;
+	if (strcmp(source, "-") != 0 && stat(source, &st) == 0 && S_ISDIR(st.st_mode))
+	{
+		DIR *dir = opendir(source);
+		if (dir == NULL)
+			return -1;
+
+		struct dirent *entry;
+		while ((entry = readdir(dir)) != NULL)
+		{
+			size_t length = strlen(entry->d_name);
+			if (length < 4 || (strcmp(entry->d_name + length - 4, ".tga") != 0 
+			 && strcmp(entry->d_name + length - 4, ".TGA") != 0))
+				continue;
+			if (batch_add(b, &capacity, source, entry->d_name) != 0)
+			{
+				closedir(dir);
+				return -1;
+			}
+		}
+		closedir(dir);
+		qsort(b->paths, b->count, sizeof(char *), batch_compare);
+		return 0;
+	}
+
+	FILE *f = strcmp(source, "-") == 0? stdin : fopen(source, "r");
+	if (f == NULL)
+		return -1;
+
+	char line[PATH_MAX];
+	int error = 0;
+	while (!error && fgets(line, sizeof(line), f))
+	{
+		line[strcspn(line, "\r\n")] = 0;
+		if (line[0] != 0)
+			error = batch_add(b, &capacity, NULL, line);
+	}
+	if (f != stdin)
+		fclose(f);
+	return error;
+}
+
+int process_batch(char const *source, char const *outdir, sobel_mode mode, int rle, uint32_t threads)
+{
+	batch b;
+	memset(&b, 0, sizeof(b));
+	b.outdir = outdir;
+	b.mode = mode;
+	b.rle = rle;
+
+	if (batch_list(&b, source) != 0)
+	{
+		printf("Could not list %s.\n", source);
+		return 1;
+	}
+	if (mkdir(outdir, 0777) != 0 && errno != EEXIST)
+	{
+		printf("Could not make %s.\n", outdir);
+		return 1;
+	}
+
+	if (threads == 0 || threads > SOBEL_MAX_THREADS)
+		threads = sobel_cpus();
+	if (threads > b.count)
+		threads = b.count > 0? b.count : 1;
+
+	pthread_mutex_init(&b.mutex, NULL);
+	pthread_t workers[SOBEL_MAX_THREADS];
+	uint32_t started = 0;
+	double start = batch_seconds();
+	while (started < threads && pthread_create(&workers[started], NULL, batch_worker, &b) == 0)
+		started++;
+	if (started == 0)
+		batch_worker(&b);
+	for (uint32_t i = 0; i < started; ++i)
+		pthread_join(workers[i], NULL);
+	double elapsed = batch_seconds() - start;
+	pthread_mutex_destroy(&b.mutex);
+
+	printf("%u images, %u failed, %.3f s, %.1f images/s\n", 
+		b.count, b.failed, elapsed, elapsed > 0? (b.count - b.failed) / elapsed : 0.0);
+	printf("%u workers, read %.3f s, compute %.3f s, write %.3f s\n", 
+		started > 0? started : 1, b.read_time, b.compute_time, b.write_time);
+
+	for (uint32_t i = 0; i < b.count; ++i)
+		free(b.paths[i]);
+	free(b.paths);
+
+	return b.failed > 0? 1 : 0;
+}
+
 #endif
 
 int main(int argc, char *argv[])
@@ -20,30 +917,64 @@ int main(int argc, char *argv[])
 	*/
 #endif
 
-	tga_read_result tga_res = tga_read(stdin, TGA_BYTES_MAX, TGA_PIXELS_MAX);
-	if (!TGA_READ_IS_SUCCESS(tga_res))
+	/*
+		-rle writes a run length encoded image.
+
+		-sobel runs the Sobel operator on the luma instead of swapping
+		channels, -channels runs it on every colour channel and 
+		-direction colours the luma edges by their direction.
+
+		-batch filters the files in a directory or list into an output
+		directory, with -threads workers.
+	*/
+	int rle = 0;
+	sobel_mode mode = SOBEL_SWAP;
+	int batch_mode = 0;
+	uint32_t threads = 0;
+	int arg = 1;
+	for (; arg < argc && argv[arg][0] == '-' && argv[arg][1] != 0; ++arg)
 	{
-		puts(tga_res.msg);
-		return tga_res.error;
+		if (strcmp(argv[arg], "-rle") == 0)
+			rle = 1;
+		else if (strcmp(argv[arg], "-sobel") == 0)
+			mode = SOBEL_LUMA;
+		else if (strcmp(argv[arg], "-channels") == 0)
+			mode = SOBEL_CHANNELS;
+		else if (strcmp(argv[arg], "-direction") == 0)
+			mode = SOBEL_DIRECTION;
+		else if (strcmp(argv[arg], "-batch") == 0)
+			batch_mode = 1;
+		else if (strcmp(argv[arg], "-threads") == 0 && arg + 1 < argc)
+			threads = (uint32_t) atoi(argv[++arg]);
+		else
+		{
+			printf("Unknown option %s.\n", argv[arg]);
+			return 1;
+		}
 	}
 
-	tga_data *tga = tga_res.data;
+	sobel_init_hues();
 
-	uint64_t stride = tga_calc_stride(tga);
-	for (uint16_t y = 0; y < tga->height; ++y)
+	if (batch_mode)
 	{
-		for (uint16_t x = 0; x < tga->width; ++x)
+		if (arg + 2 != argc)
 		{
-			uint64_t offset = (stride * y) + (x * (tga->bitdepth / 8));
-			uint8_t t = tga->data[offset];
-			tga->data[offset] = tga->data[offset + 2];
-			tga->data[offset + 2] = t;
+			puts("Usage: sobel -batch [options] <directory or list> <output directory>");
+			return 1;
 		}
+#ifndef _WIN32
+		return process_batch(argv[arg], argv[arg + 1], mode, rle, threads);
+#else
+		puts("Batch mode is not available on Windows.");
+		return 1;
+#endif
 	}
 
-	tga_write(tga, stdout);
-
-	tga_free(tga);
+	/*
+		A file given on the command line is mapped rather than read.
+	*/
+	if (arg < argc)
+		return process_file(argv[arg], mode, rle);
 
-	return 0;
-}
\ No newline at end of file
+	return mode == SOBEL_SWAP? process_stream(rle) : process_stream_sobel(mode, rle);
+}
@@ -22,8 +22,34 @@
 	THE SOFTWARE.
 */
 
+#ifndef _WIN32
+#ifdef TGA_USE_VMSPLICE
+#define _GNU_SOURCE
+#else
+#define _POSIX_C_SOURCE 200809L
+#endif
+#endif
+
 #include "tga.h"
 #include "stdlib.h"
+#include "string.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 extern uint64_t tga_len(uint16_t w, uint16_t h, uint8_t bitdepth)
 {	
@@ -32,6 +58,12 @@ extern uint64_t tga_len(uint16_t w, uint16_t h, uint8_t bitdepth)
 	return len;
 }
 
+/*
+	Scanlines made by tga_create start on multiples of this, and the 
+	block has this many bytes to spare after the last one.
+*/
+#define TGA_ALIGNMENT		64
+
 // bithdepth TGA_24BPP or TGA_32BPP
 extern tga_data *tga_create(uint32_t w, uint32_t h, uint8_t bitdepth)
 {
@@ -46,9 +78,15 @@ extern tga_data *tga_create(uint32_t w, uint32_t h, uint8_t bitdepth)
 		tga->width = w;
 		tga->height = h;
 		tga->bitdepth = bitdepth;
+		tga->stride = ((int64_t) w * (bitdepth / 8) + TGA_ALIGNMENT - 1) & ~(int64_t) (TGA_ALIGNMENT - 1);
 
-		uint64_t len = tga_len(w, h, bitdepth);
-		tga->data = malloc(len);
+		uint64_t len = (uint64_t) tga->stride * h + TGA_ALIGNMENT;
+#ifdef _WIN32
+		tga->data = _aligned_malloc(len, TGA_ALIGNMENT);
+#else
+		void *block;
+		tga->data = posix_memalign(&block, TGA_ALIGNMENT, len) == 0? block : NULL;
+#endif
 
 		if (tga->data == NULL)
 		{
@@ -62,78 +100,242 @@ extern tga_data *tga_create(uint32_t w, uint32_t h, uint8_t bitdepth)
 extern void tga_free(tga_data *tga)
 {
 	if (tga != NULL)
+	{
+#ifdef _WIN32
+		_aligned_free(tga->data);
+#else
 		free(tga->data);
+#endif
+	}
 	free(tga);
 }
 
-extern void tga_write(tga_data *data, FILE *f)
-{
-	/* Write the header. */
+/*
+	Size of the fixed part of a version 1 header.
+*/
+#define TGA_HEADER_LENGTH	18
 
+/*
+	Single byte reads for the run length decoder. The stream is locked 
+	around the whole decode, so the unlocked versions can be used where
+	they exist.
+*/
+#ifndef _WIN32
+#define TGA_LOCK(f)		flockfile(f)
+#define TGA_UNLOCK(f)	funlockfile(f)
+#define TGA_GETC(f)		getc_unlocked(f)
+#else
+#define TGA_LOCK(f)
+#define TGA_UNLOCK(f)
+#define TGA_GETC(f)		getc(f)
+#endif
+
+/*
+	Run length packet header bits, see RUN LENGTH ENCODING below.
+*/
+#define TGA_RLE_RUN_BIT			0x80
+#define TGA_RLE_MAX_PACKET		128
+
+/*
+	Fills in the TGA_HEADER_LENGTH bytes of header for data.
+*/
+static void build_header(tga_data const *data, uint8_t image_type, uint8_t *header)
+{
 	/* Identification field. */
 	/* We don't support the image identification field. */
-	putc(0, f);
+	header[0] = 0;
 
 	/* Color map type. */
 	/* Always zero because we don't support color mapped images. */
-	putc(0, f);
+	header[1] = 0;
 
 	/* Image type code. */
-	/* Always 2 since we only support uncompressed RGB. */
-	putc(2, f);
+	/* Uncompressed or run length encoded RGB. */
+	header[2] = image_type;
 
 	/*  Color map specification, not used. */
-	for (int i = 0; i < 5; i++)
-		putc(0, f);
+	for (int i = 3; i < 8; i++)
+		header[i] = 0;
 
 	/* X-origin. lo-hi 2 byte integer. */
-	putc(0, f); putc(0, f);
+	header[8] = 0; header[9] = 0;
 
 	/* Y-origin. lo-hi 2 byte integer. */
-	putc(0, f); putc(0, f);
+	header[10] = 0; header[11] = 0;
 
 	/* Image width. lo-hi 2 byte integer. */
-	putc(data->width & 0x00FF, f);
-	putc((data->width & 0xFF00) >> 8, f);
+	header[12] = data->width & 0x00FF;
+	header[13] = (data->width & 0xFF00) >> 8;
 
 	/* Image height. lo-hi 2 byte integer. */
-	putc(data->height & 0x00FF, f);
-	putc((data->height & 0xFF00) >> 8, f);
+	header[14] = data->height & 0x00FF;
+	header[15] = (data->height & 0xFF00) >> 8;
 
 	/* Image Pixel Size (amount of bits per pixel.) */
-	putc(data->bitdepth, f);
+	header[16] = data->bitdepth;
 
 	/* Image Descriptor Byte */
-	putc(data->bitdepth == TGA_32BPP? 0x08 : 0x00, f);
+	header[17] = data->bitdepth == TGA_32BPP? 0x08 : 0x00;
+	if (data->stride > 0)
+		header[17] |= TGA_IMAGE_DESCRIPTOR_SCREEN_ORIGIN_BIT_MASK;
+}
 
-	/* Write the image data. */
-	uint64_t len = tga_len(data->width, data->height, data->bitdepth);
+extern void tga_write(tga_data *data, FILE *f)
+{
+	if (data == NULL)
+		return;
 
-	for (uint64_t i = 0; i < len; ++i)
+	/* Write the header. */
+	uint8_t header[TGA_HEADER_LENGTH];
+	build_header(data, TGA_IMAGE_TYPE_UNCOMPRESSED_RGB, header);
+	fwrite(header, 1, TGA_HEADER_LENGTH, f);
+
+	/* 
+		Write the image data. A write this large goes past the stream 
+		buffer straight to the file. Padded scanlines go one by one.
+	*/
+	uint64_t const len = (uint64_t) data->width * (data->bitdepth / 8);
+	uint64_t const pitch = tga_calc_stride(data);
+	if (pitch == len)
+		fwrite(data->data, 1, len * data->height, f);
+	else
 	{
-		putc(data->data[i], f);
+		for (uint32_t y = 0; y < data->height; y++)
+			fwrite(data->data + y * pitch, 1, len, f);
 	}
 }
 
-/* 
-	tga_read helper macros. 
-	Assumes the following is defined in the scope it is used in:
-		FILE *f;
-		uint64_t maxbytes;
-		uint64_t maxpixels;
+#ifndef _WIN32
+
+/*
+	Writes all of len bytes to fd. Non-zero splice lets them be spliced
+	into a pipe by reference, for image data the caller keeps alive; 
+	anything else, such as a header on the stack, is copied. Returns 0 
+	on success.
+*/
+static int write_all(int fd, uint8_t const *bytes, uint64_t len, int splice)
+{
+#ifndef TGA_USE_VMSPLICE
+	(void) splice;
+#endif
+	while (len > 0)
+	{
+		size_t chunk = len > SSIZE_MAX? SSIZE_MAX : (size_t) len;
+		ssize_t n;
+#ifdef TGA_USE_VMSPLICE
+		/*
+			Hands the pages to the pipe instead of copying them. Fails 
+			with EBADF or EINVAL if fd isn't a pipe, then we just write.
+		*/
+		if (splice)
+		{
+			struct iovec iov = { (void *) bytes, chunk };
+			n = vmsplice(fd, &iov, 1, 0);
+			if (n < 0 && (errno == EBADF || errno == EINVAL))
+			{
+				splice = 0;
+				continue;
+			}
+		}
+		else
+			n = write(fd, bytes, chunk);
+#else
+		n = write(fd, bytes, chunk);
+#endif
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		bytes += n;
+		len -= n;
+	}
+	return 0;
+}
 
-	Tries to read a byte into var and increment count.
+/*
+	Scanlines gathered into a single writev.
+*/
+#define TGA_IOV_ROWS	64
 
-	If fgetc fails, jumps to errorloc. Jumps to errorloc if count >= maxbytes.
+/*
+	Writes n scanlines of len bytes, pitch bytes apart, to fd. Padded 
+	scanlines are gathered with writev, or vmsplice, so the padding 
+	doesn't need to be copied out first. Returns 0 on success.
 */
-#define TRY_READ_BYTE(var, count, errorloc) \
-		{\
-			if ((count) == maxbytes) { goto errorloc; } \
-			int byte = fgetc(f); \
-			if (byte == EOF) { goto errorloc; } \
-			(var) = byte; \
-			count++; \
+static int write_rows(int fd, uint8_t const *rows, uint32_t n, uint64_t len, uint64_t pitch)
+{
+	if (pitch == len)
+		return write_all(fd, rows, len * n, 1);
+
+#ifdef TGA_USE_VMSPLICE
+	int splice = 1;
+#endif
+	struct iovec iov[TGA_IOV_ROWS];
+	while (n > 0)
+	{
+		uint32_t const k = n < TGA_IOV_ROWS? n : TGA_IOV_ROWS;
+		for (uint32_t i = 0; i < k; i++)
+		{
+			iov[i].iov_base = (void *) (rows + i * pitch);
+			iov[i].iov_len = len;
+		}
+
+		ssize_t written;
+#ifdef TGA_USE_VMSPLICE
+		if (splice)
+		{
+			written = vmsplice(fd, iov, k, 0);
+			if (written < 0 && (errno == EBADF || errno == EINVAL))
+			{
+				splice = 0;
+				continue;
+			}
 		}
+		else
+			written = writev(fd, iov, k);
+#else
+		written = writev(fd, iov, k);
+#endif
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written <= 0)
+			return -1;
+
+		/* A short write leaves part of a scanline, which is finished off here. */
+		uint64_t const done = (uint64_t) written / len;
+		uint64_t const part = (uint64_t) written % len;
+		if (part > 0 && write_all(fd, rows + done * pitch + part, len - part, 1) != 0)
+			return -1;
+
+		uint32_t const rows_done = (uint32_t) done + (part > 0);
+		rows += rows_done * pitch;
+		n -= rows_done;
+	}
+	return 0;
+}
+
+extern int tga_write_fd(tga_data *data, int fd)
+{
+	if (data == NULL)
+		return 0;
+
+	uint8_t header[TGA_HEADER_LENGTH];
+	build_header(data, TGA_IMAGE_TYPE_UNCOMPRESSED_RGB, header);
+
+	uint64_t const len = (uint64_t) data->width * (data->bitdepth / 8);
+	if (write_all(fd, header, TGA_HEADER_LENGTH, 0) != 0
+	 || write_rows(fd, data->data, data->height, len, tga_calc_stride(data)) != 0)
+		return -1;
+
+	return 0;
+}
+
+#endif
+
+/*
+	Size of the chunks the image data is read in.
+*/
+#define TGA_READ_CHUNK		(1 << 20)
 
 #define RETURN_ERROR(msg, code) { return (tga_read_result) { 0, (msg), (code) }; }
 
@@ -144,84 +346,376 @@ uint16_t from_lo_hi(uint8_t lo, uint8_t hi)
 	return final;
 }
 
-extern tga_read_result tga_read(FILE *f, uint64_t maxbytes, uint64_t maxpixels)
+/*
+	tga_read helper.
+
+	Reads n bytes into dst, never reading past maxbytes in total. 
+	count is the number of bytes read so far and is updated.
+
+	Returns TGA_READ_SUCCESS, TGA_ERROR_READ_TOO_FAR if maxbytes would 
+	be exceeded or TGA_ERROR_READ_EOF.
+*/
+static uint16_t read_bytes(FILE *f, uint8_t *dst, uint64_t n, uint64_t *count, uint64_t maxbytes)
 {
-	uint64_t nbytes = 0;
-	uint8_t lastbyte = 0;
+	int too_far = 0;
+	if (n > maxbytes - *count)
+	{
+		n = maxbytes - *count;
+		too_far = 1;
+	}
+
+	while (n > 0)
+	{
+		size_t chunk = n > TGA_READ_CHUNK? TGA_READ_CHUNK : (size_t) n;
+		size_t got = fread(dst, 1, chunk, f);
+		*count += got;
+		dst += got;
+		n -= got;
+		if (got != chunk)
+			return TGA_ERROR_READ_EOF;
+	}
+
+	return too_far? TGA_ERROR_READ_TOO_FAR : TGA_READ_SUCCESS;
+}
+
+/*
+	RUN LENGTH ENCODING.
+
+	Type 10 image data is a sequence of packets. The packet header byte 
+	has the pixel count minus one in its low 7 bits. With the high bit 
+	set one pixel follows, repeated count times, otherwise count pixels 
+	follow as is.
+*/
+
+/*
+	Fills n pixels at dst with the bpp bytes of pixel, by doubling the 
+	filled part with memcpy.
+*/
+static void fill_run(uint8_t *dst, uint8_t const *pixel, uint32_t n, int bpp)
+{
+	uint64_t const len = (uint64_t) n * bpp;
+	uint64_t filled = bpp;
+	memcpy(dst, pixel, bpp);
+	while (filled < len)
+	{
+		uint64_t copy = filled < len - filled? filled : len - filled;
+		memcpy(dst + filled, dst, copy);
+		filled += copy;
+	}
+}
+
+/*
+	Decodes the packets in the len bytes at src into the pixels * bpp 
+	bytes at dst.
+
+	Returns TGA_READ_SUCCESS, TGA_ERROR_READ_EOF or 
+	TGA_ERROR_READ_MALFORMED_DATA if a packet runs past the image.
+*/
+static uint16_t decode_rle_memory(
+	uint8_t const *src, 
+	uint64_t len, 
+	uint8_t *dst, 
+	uint64_t pixels, 
+	int bpp)
+{
+	uint8_t const *const end = src + len;
+	uint64_t p = 0;
+	while (p < pixels)
+	{
+		if (src == end)
+			return TGA_ERROR_READ_EOF;
+
+		uint8_t const packet = *src++;
+		uint32_t const n = (packet & ~TGA_RLE_RUN_BIT) + 1;
+		uint64_t const bytes = (packet & TGA_RLE_RUN_BIT)? bpp : (uint64_t) n * bpp;
+		if (n > pixels - p)
+			return TGA_ERROR_READ_MALFORMED_DATA;
+		if (bytes > (uint64_t) (end - src))
+			return TGA_ERROR_READ_EOF;
+
+		uint8_t *out = dst + p * bpp;
+		if (packet & TGA_RLE_RUN_BIT)
+			fill_run(out, src, n, bpp);
+		else
+			memcpy(out, src, bytes);
+
+		src += bytes;
+		p += n;
+	}
+	return TGA_READ_SUCCESS;
+}
+
+/*
+	Returns the number of pixels, at most max, from p on that are equal
+	to the pixel at p.
 
-	uint8_t imageident_len = 0;
+	Pixel i equals pixel i + 1 for every i < n exactly when the bytes at
+	p and p + bpp agree for n * bpp bytes, so the run can be found by 
+	comparing two byte ranges, 16 bytes at a time with SSE2.
+*/
+static uint32_t run_length(uint8_t const *p, uint32_t max, int bpp)
+{
+	uint64_t const bytes = (uint64_t) (max - 1) * bpp;
+	uint64_t i = 0;
+#ifdef __SSE2__
+	while (i + 16 <= bytes)
+	{
+		__m128i a = _mm_loadu_si128((__m128i const *) (p + i));
+		__m128i b = _mm_loadu_si128((__m128i const *) (p + i + bpp));
+		unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+		if (mask != 0xFFFF)
+			return 1 + (i + __builtin_ctz(~mask)) / bpp;
+		i += 16;
+	}
+#endif
+	while (i < bytes && p[i] == p[i + bpp])
+		i++;
+	return 1 + i / bpp;
+}
+
+/*
+	Encodes a scanline of width pixels at src into dst, which must hold
+	at least width * bpp + (width + 127) / 128 bytes. Packets never 
+	cross scanlines, as version 2 of the format asks.
+
+	Returns the number of bytes written.
+*/
+static uint64_t encode_rle_line(uint8_t const *src, uint32_t width, int bpp, uint8_t *dst)
+{
+	uint8_t *out = dst;
+	uint32_t x = 0;
+	while (x < width)
+	{
+		uint32_t const left = width - x < TGA_RLE_MAX_PACKET? width - x : TGA_RLE_MAX_PACKET;
+		uint32_t const run = run_length(src + (uint64_t) x * bpp, left, bpp);
+		if (run > 1)
+		{
+			*out++ = TGA_RLE_RUN_BIT | (run - 1);
+			memcpy(out, src + (uint64_t) x * bpp, bpp);
+			out += bpp;
+			x += run;
+			continue;
+		}
+
+		/* Raw pixels up to where the next run starts. */
+		uint32_t n = 1;
+		while (n < left && (n + 1 == left 
+			|| memcmp(src + (uint64_t) (x + n) * bpp, src + (uint64_t) (x + n + 1) * bpp, bpp) != 0))
+			n++;
+
+		*out++ = n - 1;
+		memcpy(out, src + (uint64_t) x * bpp, (uint64_t) n * bpp);
+		out += (uint64_t) n * bpp;
+		x += n;
+	}
+	return out - dst;
+}
+
+extern void tga_write_rle(tga_data *data, FILE *f)
+{
+	if (data == NULL)
+		return;
+
+	uint8_t header[TGA_HEADER_LENGTH];
+	build_header(data, TGA_IMAGE_TYPE_RLE_RGB, header);
+	fwrite(header, 1, TGA_HEADER_LENGTH, f);
+
+	/*
+		Encoded a scanline at a time, the worst case being all raw 
+		packets.
+	*/
+	int const bpp = data->bitdepth / 8;
+	uint64_t const stride = tga_calc_stride(data);
+	uint8_t *line = malloc((uint64_t) data->width * bpp + (data->width + TGA_RLE_MAX_PACKET - 1) / TGA_RLE_MAX_PACKET);
+	for (uint32_t y = 0; y < data->height; y++)
+	{
+		uint8_t const *src = data->data + y * stride;
+		if (line != NULL)
+		{
+			uint64_t len = encode_rle_line(src, data->width, bpp, line);
+			fwrite(line, 1, len, f);
+			continue;
+		}
+
+		/* Out of memory, so we can only write raw packets. */
+		for (uint32_t x = 0; x < data->width; x += TGA_RLE_MAX_PACKET)
+		{
+			uint32_t n = data->width - x < TGA_RLE_MAX_PACKET? data->width - x : TGA_RLE_MAX_PACKET;
+			putc(n - 1, f);
+			fwrite(src + (uint64_t) x * bpp, bpp, n, f);
+		}
+	}
+
+	free(line);
+}
+
+/*
+	Fills in the fixed part of h from the TGA_HEADER_LENGTH bytes in raw
+	and checks that we support the image it describes.
+
+	Returns a result with a NULL data pointer, TGA_READ_SUCCESS if the 
+	header is usable.
+*/
+static tga_read_result parse_header(uint8_t const *raw, tga_version1_header *h)
+{
 	/* Identification field. */
-	TRY_READ_BYTE(imageident_len, nbytes, streamerror);
+	h->identification_field_length = raw[0];
 
 	/* Color map type. */
 	/* Always zero because we don't support color mapped images. */
-	TRY_READ_BYTE(lastbyte, nbytes, streamerror);
-	if (lastbyte != 0) 
+	h->color_map_type = raw[1];
+	if (h->color_map_type != 0) 
 		RETURN_ERROR("Color mapped pictures not supported.", TGA_ERROR_READ_COLOR_MAPPED);
 
 	/* Image type code. */
-	/* Always 2 since we only support uncompressed RGB. */
-	TRY_READ_BYTE(lastbyte, nbytes, streamerror);
-	if (lastbyte != 2)
+	/* Uncompressed or run length encoded RGB. */
+	h->image_type_code = raw[2];
+	if (h->image_type_code != TGA_IMAGE_TYPE_UNCOMPRESSED_RGB
+	 && h->image_type_code != TGA_IMAGE_TYPE_RLE_RGB)
 		RETURN_ERROR("Compression not supported.", TGA_ERROR_READ_COMPRESSED);
 
 	/*  Color map specification, not used. */
-	for (int i = 0; i < 5; i++)
-		TRY_READ_BYTE(lastbyte, nbytes, streamerror);
+	h->color_map_origin = from_lo_hi(raw[3], raw[4]);
+	h->color_map_length = from_lo_hi(raw[5], raw[6]);
+	h->color_map_entry_size = raw[7];
 
-	/* X-origin. lo-hi 2 byte integer. */
-	TRY_READ_BYTE(lastbyte, nbytes, streamerror);
-	TRY_READ_BYTE(lastbyte, nbytes, streamerror);
-		
-	/* Y-origin. lo-hi 2 byte integer. */
-	TRY_READ_BYTE(lastbyte, nbytes, streamerror);
-	TRY_READ_BYTE(lastbyte, nbytes, streamerror);
+	/* X-origin and Y-origin. lo-hi 2 byte integers. */
+	h->x_origin = from_lo_hi(raw[8], raw[9]);
+	h->y_origin = from_lo_hi(raw[10], raw[11]);
 	
-	uint16_t width = 0;
-	uint16_t height = 0;
-	/* Image width. lo-hi 2 byte integer. */
-	TRY_READ_BYTE(lastbyte, nbytes, streamerror);
-	TRY_READ_BYTE(width, nbytes, streamerror);
-	width = from_lo_hi(lastbyte, width);
-
-	/* Image height. lo-hi 2 byte integer. */
-	TRY_READ_BYTE(lastbyte, nbytes, streamerror);
-	TRY_READ_BYTE(height, nbytes, streamerror);
-	height = from_lo_hi(lastbyte, height);
+	/* Image width and height. lo-hi 2 byte integers. */
+	h->width = from_lo_hi(raw[12], raw[13]);
+	h->height = from_lo_hi(raw[14], raw[15]);
 
 	/* Sanity check image & height. */
-	if (width == 0)
+	if (h->width == 0)
 		RETURN_ERROR("Width reported as zero.", TGA_ERROR_READ_INVALID_DIMENSIONS);
-	if (height == 0)
+	if (h->height == 0)
 		RETURN_ERROR("Height reported as zero.", TGA_ERROR_READ_INVALID_DIMENSIONS);
 
-	uint8_t bitdepth;
 	/* Image Pixel Size (amount of bits per pixel.) */
-	TRY_READ_BYTE(lastbyte, nbytes, streamerror);
-	bitdepth = lastbyte;
+	h->image_pixel_size = raw[16];
 
-	if (bitdepth != TGA_24BPP && bitdepth != TGA_32BPP)
+	if (h->image_pixel_size != TGA_24BPP && h->image_pixel_size != TGA_32BPP)
 		RETURN_ERROR(
 			"TGA header indicated unsupported bitdepth, only 24bpp and 32bpp are supported.", 
 			TGA_ERROR_READ_BITDEPTH);
 
 	/* Image Descriptor Byte */
-	TRY_READ_BYTE(lastbyte, nbytes, streamerror);
-	if (bitdepth == TGA_32BPP && (lastbyte & 0x08) != 8)
+	h->image_descriptor_byte = raw[17];
+	if (h->image_pixel_size == TGA_32BPP && (h->image_descriptor_byte & 0x08) != 8)
 	{
 		RETURN_ERROR(
 			"Header indicated 32bpp, but Image Descriptor is contraditory.", 
 			TGA_ERROR_READ_MALFORMED_HEADER);
 	}
-	else if (bitdepth == TGA_24BPP && (lastbyte & 0x08) != 0)
+	else if (h->image_pixel_size == TGA_24BPP && (h->image_descriptor_byte & 0x08) != 0)
 		RETURN_ERROR(
 			"Header indicated 24bpp, but Image Descriptor is contraditory.",
 			TGA_ERROR_READ_MALFORMED_HEADER);
+	if ((h->image_descriptor_byte & TGA_IMAGE_DESCRIPTOR_INTERLEAVING_FLAG) == TGA_IMAGE_DESCRIPTOR_INTERLEAVING_FLAG)
+		RETURN_ERROR(
+			"Image Descriptor indicated reserved interleaving.",
+			TGA_ERROR_READ_MALFORMED_HEADER);
 	// Todo: More sanity checking for rest of Image Descriptor data here.
 
+	return (tga_read_result) { 0, "Header is valid.", TGA_READ_SUCCESS };
+}
+
+/*
+	Turns a status from the stream functions into a result.
+*/
+static tga_read_result status_result(uint16_t status)
+{
+	switch (status)
+	{
+	case TGA_READ_SUCCESS:
+		return (tga_read_result) { 0, "Read was succesful.", TGA_READ_SUCCESS };
+	case TGA_ERROR_READ_TOO_FAR:
+		RETURN_ERROR("Image data was larger than permitted.", TGA_ERROR_READ_TOO_FAR);
+	case TGA_ERROR_READ_MALFORMED_DATA:
+		RETURN_ERROR("Run length packet runs past the image.", TGA_ERROR_READ_MALFORMED_DATA);
+	case TGA_ERROR_READ_OOM:
+		RETURN_ERROR("Could not allocate memory for image data.", TGA_ERROR_READ_OOM);
+	default:
+		RETURN_ERROR("Stream error or unexpected EOF.", TGA_ERROR_READ_EOF);
+	}
+}
+
+/*
+	ORIGIN AND INTERLEAVING.
+*/
+
+/*
+	The number of ways the scanlines of an image are interleaved.
+*/
+static uint32_t interleave_ways(uint8_t descriptor)
+{
+	return 1u << ((descriptor & TGA_IMAGE_DESCRIPTOR_INTERLEAVING_FLAG) >> 6);
+}
+
+/*
+	The scanline stored i-th in an image interleaved ways ways, counted
+	in the order it would be stored in without interleaving. The file 
+	holds every ways-th scanline from the first, then every ways-th 
+	from the second and so on.
+*/
+static uint32_t deinterleaved_row(uint32_t i, uint32_t height, uint32_t ways)
+{
+	for (uint32_t pass = 0; pass < ways; ++pass)
+	{
+		uint32_t const rows = (height - pass + ways - 1) / ways;
+		if (i < rows)
+			return pass + i * ways;
+		i -= rows;
+	}
+	return i;
+}
+
+/*
+	Sets the sign of the stride of tga from the screen origin bit of its
+	descriptor.
+*/
+static void set_origin(tga_data *tga, uint8_t descriptor)
+{
+	int64_t const stride = (int64_t) tga_calc_stride(tga);
+	tga->stride = (descriptor & TGA_IMAGE_DESCRIPTOR_SCREEN_ORIGIN_BIT_MASK)? stride : -stride;
+}
+
+/*
+	STREAMS.
+*/
+
+extern tga_read_result tga_read_open(tga_stream *s, FILE *f, uint64_t maxbytes, uint64_t maxpixels)
+{
+	uint8_t raw[TGA_HEADER_LENGTH];
+	uint16_t status;
+
+	s->f = f;
+	s->nbytes = 0;
+	s->maxbytes = maxbytes;
+	s->row = 0;
+	s->packet_left = 0;
+	s->line = NULL;
+
+	if ((status = read_bytes(f, raw, TGA_HEADER_LENGTH, &s->nbytes, maxbytes)) != TGA_READ_SUCCESS)
+		return status_result(status);
+
+	tga_version1_header header;
+	tga_read_result header_result = parse_header(raw, &header);
+	if (!TGA_READ_IS_SUCCESS(header_result))
+		return header_result;
+
+	s->width = header.width;
+	s->height = header.height;
+	s->bitdepth = header.image_pixel_size;
+	s->image_type = header.image_type_code;
+	s->descriptor = header.image_descriptor_byte;
+
 	/* Read and throw away image identification field. */
-	for (int i = 0; i < imageident_len; ++i)
-		TRY_READ_BYTE(lastbyte, nbytes, streamerror);
+	if ((status = read_bytes(f, header.image_identification_field, 
+			header.identification_field_length, &s->nbytes, maxbytes)) != TGA_READ_SUCCESS)
+		return status_result(status);
 
 	/* 
 		Here we could read the Color map data, but we don't support it
@@ -230,47 +724,661 @@ extern tga_read_result tga_read(FILE *f, uint64_t maxbytes, uint64_t maxpixels)
 		So we just don't.
 	*/
 
+	if ((uint64_t) s->width * s->height > maxpixels)
+		RETURN_ERROR("Image data was larger than permitted", TGA_ERROR_READ_TOO_FAR);
+
+	return status_result(TGA_READ_SUCCESS);
+}
+
+/*
+	Decodes the next pixels pixels of a run length encoded stream into 
+	dst. Packets may span calls, what is left of the current one is kept
+	in the stream.
+*/
+static uint16_t stream_decode_rle(tga_stream *s, uint8_t *dst, uint64_t pixels)
+{
+	FILE *f = s->f;
+	int const bpp = s->bitdepth / 8;
+	/* Pixels left in the image after this call, no packet may reach them. */
+	uint64_t const after = (uint64_t) (s->height - s->row) * s->width - pixels;
+
 	/*
-		Read the image data. Pretty straightforward.
+		The compressed size isn't known up front, and reading ahead 
+		would eat whatever follows the image in the stream. So packets 
+		are read one by one, the small reads through the stream buffer 
+		with the stream locked once for the whole call.
 	*/
-	tga_data *tga = tga_create(width, height, bitdepth);
+	uint64_t p = 0;
+	uint16_t status = TGA_READ_SUCCESS;
+	TGA_LOCK(f);
+	while (p < pixels)
+	{
+		if (s->packet_left == 0)
+		{
+			if (s->nbytes == s->maxbytes)
+			{
+				status = TGA_ERROR_READ_TOO_FAR;
+				break;
+			}
+
+			int packet = TGA_GETC(f);
+			if (packet == EOF)
+			{
+				status = TGA_ERROR_READ_EOF;
+				break;
+			}
+			s->nbytes += 1;
+
+			uint32_t const n = (packet & ~TGA_RLE_RUN_BIT) + 1;
+			if (n > pixels - p + after)
+			{
+				status = TGA_ERROR_READ_MALFORMED_DATA;
+				break;
+			}
+
+			s->packet_run = (packet & TGA_RLE_RUN_BIT) != 0;
+			if (s->packet_run)
+			{
+				if (bpp > s->maxbytes - s->nbytes)
+				{
+					status = TGA_ERROR_READ_TOO_FAR;
+					break;
+				}
+
+				for (int i = 0; i < bpp; i++)
+					s->packet_pixel[i] = TGA_GETC(f);
+				if (feof(f) || ferror(f))
+				{
+					status = TGA_ERROR_READ_EOF;
+					break;
+				}
+				s->nbytes += bpp;
+			}
+			s->packet_left = n;
+		}
+
+		uint32_t const n = s->packet_left < pixels - p? s->packet_left : (uint32_t) (pixels - p);
+		uint8_t *out = dst + p * bpp;
+		if (s->packet_run)
+			fill_run(out, s->packet_pixel, n, bpp);
+		else if ((status = read_bytes(f, out, (uint64_t) n * bpp, &s->nbytes, s->maxbytes)) != TGA_READ_SUCCESS)
+			break;
+
+		s->packet_left -= n;
+		p += n;
+	}
+	TGA_UNLOCK(f);
+	return status;
+}
+
+extern uint16_t tga_read_rows(tga_stream *s, uint8_t *rows, uint32_t n)
+{
+	if (n > s->height - s->row)
+		return TGA_ERROR_READ_TOO_FAR;
+
+	uint64_t const pixels = (uint64_t) n * s->width;
+	uint16_t status = s->image_type == TGA_IMAGE_TYPE_RLE_RGB?
+		stream_decode_rle(s, rows, pixels) :
+		read_bytes(s->f, rows, pixels * (s->bitdepth / 8), &s->nbytes, s->maxbytes);
+
+	if (status == TGA_READ_SUCCESS)
+		s->row += n;
+	return status;
+}
+
+extern void tga_read_close(tga_stream *s)
+{
+	s->f = NULL;
+}
+
+extern int tga_write_open(tga_stream *s, FILE *f, uint16_t w, uint16_t h, uint8_t bitdepth, int top_down, int rle)
+{
+	if (w < 1 || h < 1)
+		return -1;
+	if (bitdepth != TGA_24BPP && bitdepth != TGA_32BPP)
+		return -1;
+
+	s->f = f;
+	s->width = w;
+	s->height = h;
+	s->bitdepth = bitdepth;
+	s->image_type = rle? TGA_IMAGE_TYPE_RLE_RGB : TGA_IMAGE_TYPE_UNCOMPRESSED_RGB;
+	s->descriptor = top_down? TGA_IMAGE_DESCRIPTOR_SCREEN_ORIGIN_BIT_MASK : 0;
+	s->row = 0;
+	s->nbytes = 0;
+	s->maxbytes = TGA_BYTES_MAX;
+	s->packet_left = 0;
+	s->line = NULL;
+
+	/*
+		Worst case for an encoded scanline is all raw packets.
+	*/
+	if (rle)
+	{
+		s->line = malloc((uint64_t) w * (bitdepth / 8) + (w + TGA_RLE_MAX_PACKET - 1) / TGA_RLE_MAX_PACKET);
+		if (s->line == NULL)
+			return -1;
+	}
+
+	int64_t const stride = (int64_t) w * (bitdepth / 8);
+	tga_data const image = { w, h, NULL, bitdepth, top_down? stride : -stride };
+	uint8_t header[TGA_HEADER_LENGTH];
+	build_header(&image, s->image_type, header);
+	if (fwrite(header, 1, TGA_HEADER_LENGTH, f) != TGA_HEADER_LENGTH)
+	{
+		free(s->line);
+		s->line = NULL;
+		return -1;
+	}
+	s->nbytes = TGA_HEADER_LENGTH;
+	return 0;
+}
+
+extern int tga_write_rows(tga_stream *s, uint8_t const *rows, uint32_t n)
+{
+	if (n > s->height - s->row)
+		return -1;
+
+	uint64_t const stride = (uint64_t) s->width * (s->bitdepth / 8);
+	if (s->image_type == TGA_IMAGE_TYPE_RLE_RGB)
+	{
+		for (uint32_t y = 0; y < n; y++)
+		{
+			uint64_t len = encode_rle_line(rows + y * stride, s->width, s->bitdepth / 8, s->line);
+			if (fwrite(s->line, 1, len, s->f) != len)
+				return -1;
+			s->nbytes += len;
+		}
+	}
+	else
+	{
+		if (fwrite(rows, 1, n * stride, s->f) != n * stride)
+			return -1;
+		s->nbytes += n * stride;
+	}
+
+	s->row += n;
+	return 0;
+}
+
+extern int tga_write_close(tga_stream *s)
+{
+	free(s->line);
+	s->line = NULL;
+
+	int complete = s->row == s->height;
+	if (fflush(s->f) != 0)
+		complete = 0;
+	s->f = NULL;
+	return complete? 0 : -1;
+}
+
+extern tga_read_result tga_read(FILE *f, uint64_t maxbytes, uint64_t maxpixels)
+{
+	tga_stream s;
+	tga_read_result result = tga_read_open(&s, f, maxbytes, maxpixels);
+	if (!TGA_READ_IS_SUCCESS(result))
+		return result;
+
+	/*
+		Read the image data. Pretty straightforward, unless it is 
+		interleaved. Then every scanline is read straight to where it 
+		belongs.
+	*/
+	tga_data *tga = tga_create(s.width, s.height, s.bitdepth);
 	if (!tga)
 		RETURN_ERROR("Could not allocate memory for image data.", TGA_ERROR_READ_OOM);
+	set_origin(tga, s.descriptor);
 
-	uint64_t expected_bytes = tga_len(width, height, bitdepth);
-	uint64_t bytes_per_pixel = bitdepth == TGA_32BPP? 4 : 3;
-	for (int i = 0; i < expected_bytes; ++i)
+	uint16_t status = TGA_READ_SUCCESS;
+	uint32_t const ways = interleave_ways(s.descriptor);
+	uint64_t const stride = tga_calc_stride(tga);
+	if (ways == 1 && stride == (uint64_t) s.width * (s.bitdepth / 8))
+		status = tga_read_rows(&s, tga->data, s.height);
+	else
 	{
-		if ((i / bytes_per_pixel) == maxpixels)
+		for (uint32_t i = 0; i < s.height && status == TGA_READ_SUCCESS; ++i)
+			status = tga_read_rows(&s, tga->data + deinterleaved_row(i, s.height, ways) * stride, 1);
+	}
+	tga_read_close(&s);
+	if (status != TGA_READ_SUCCESS)
+	{
+		tga_free(tga);
+		return status_result(status);
+	}
+
+	result.data = tga;
+	return result;
+}
+
+#ifndef _WIN32
+
+/*
+	A mapped image. The tga_data handed out is the first member, so 
+	tga_unmap can get back to the mapping from it.
+
+	Run length encoded images can't be used in place. They are decoded
+	into memory of their own and the file is unmapped right away, base
+	is then NULL.
+*/
+typedef struct tga_mapping_s
+{
+	tga_data tga;
+	void *base;
+	size_t length;
+} tga_mapping;
+
+extern tga_read_result tga_map(char const *filename, uint64_t maxpixels)
+{
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		RETURN_ERROR("Could not open file.", TGA_ERROR_READ_IO);
+
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+	{
+		close(fd);
+		RETURN_ERROR("Could not open file.", TGA_ERROR_READ_IO);
+	}
+	if ((uint64_t) st.st_size < TGA_HEADER_LENGTH)
+	{
+		close(fd);
+		RETURN_ERROR("Stream error or unexpected EOF.", TGA_ERROR_READ_EOF);
+	}
+
+	/*
+		Private and writable, so filters can work in place. Only the 
+		pages they write to get copied, and never back to the file.
+	*/
+	size_t const length = st.st_size;
+	void *base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		RETURN_ERROR("Could not map file.", TGA_ERROR_READ_IO);
+
+	uint8_t *bytes = base;
+	tga_version1_header header;
+	tga_read_result result = parse_header(bytes, &header);
+	if (!TGA_READ_IS_SUCCESS(result))
+	{
+		munmap(base, length);
+		return result;
+	}
+
+	uint64_t const offset = TGA_HEADER_LENGTH + header.identification_field_length;
+	uint64_t const expected_bytes = tga_len(header.width, header.height, header.image_pixel_size);
+	if ((uint64_t) header.width * header.height > maxpixels)
+	{
+		munmap(base, length);
+		RETURN_ERROR("Image data was larger than permitted", TGA_ERROR_READ_TOO_FAR);
+	}
+	int const rle = header.image_type_code == TGA_IMAGE_TYPE_RLE_RGB;
+	if (length < offset + (rle? 0 : expected_bytes))
+	{
+		munmap(base, length);
+		RETURN_ERROR("Stream error or unexpected EOF.", TGA_ERROR_READ_EOF);
+	}
+
+	tga_mapping *mapping = malloc(sizeof(tga_mapping));
+	if (mapping == NULL)
+	{
+		munmap(base, length);
+		RETURN_ERROR("Could not allocate memory for image data.", TGA_ERROR_READ_OOM);
+	}
+
+	posix_madvise(base, length, POSIX_MADV_SEQUENTIAL);
+
+	mapping->tga.width = header.width;
+	mapping->tga.height = header.height;
+	mapping->tga.bitdepth = header.image_pixel_size;
+	mapping->tga.data = bytes + offset;
+	mapping->base = base;
+	mapping->length = length;
+	mapping->tga.stride = (int64_t) header.width * (header.image_pixel_size / 8);
+	set_origin(&mapping->tga, header.image_descriptor_byte);
+
+	/*
+		Interleaved scanlines have to be put in order, which can't be 
+		done in the mapping either.
+	*/
+	uint32_t const ways = interleave_ways(header.image_descriptor_byte);
+	if (rle || ways > 1)
+	{
+		uint8_t *pixels = bytes + offset;
+		uint16_t status = TGA_READ_SUCCESS;
+		if (rle)
+		{
+			pixels = malloc(expected_bytes);
+			status = pixels == NULL? TGA_ERROR_READ_OOM :
+				decode_rle_memory(bytes + offset, length - offset, pixels, 
+					(uint64_t) header.width * header.height, header.image_pixel_size / 8);
+		}
+
+		mapping->tga.data = pixels;
+		if (status == TGA_READ_SUCCESS && ways > 1)
 		{
-			RETURN_ERROR("Image data was larger than permitted", TGA_ERROR_READ_TOO_FAR);
+			uint64_t const stride = tga_calc_stride(&mapping->tga);
+			mapping->tga.data = malloc(expected_bytes);
+			if (mapping->tga.data == NULL)
+				status = TGA_ERROR_READ_OOM;
+			else
+			{
+				for (uint32_t i = 0; i < header.height; ++i)
+					memcpy(mapping->tga.data + deinterleaved_row(i, header.height, ways) * stride, 
+						pixels + i * stride, stride);
+			}
+			if (rle)
+				free(pixels);
 		}
+		mapping->base = NULL;
+		munmap(base, length);
 
-		TRY_READ_BYTE(lastbyte, nbytes, streamerror);
-		tga->data[i] = lastbyte;
+		if (status != TGA_READ_SUCCESS)
+		{
+			free(mapping->tga.data);
+			free(mapping);
+			if (status == TGA_ERROR_READ_OOM)
+				RETURN_ERROR("Could not allocate memory for image data.", TGA_ERROR_READ_OOM);
+			if (status == TGA_ERROR_READ_MALFORMED_DATA)
+				RETURN_ERROR("Run length packet runs past the image.", TGA_ERROR_READ_MALFORMED_DATA);
+			RETURN_ERROR("Stream error or unexpected EOF.", TGA_ERROR_READ_EOF);
+		}
 	}
 
-	tga_read_result result;
-	result.data = tga;
+	result.data = &mapping->tga;
 	result.msg = "Read was succesful.";
 	result.error = TGA_READ_SUCCESS;
+	return result;
+}
+
+extern void tga_unmap(tga_data *tga)
+{
+	if (tga == NULL)
+		return;
 
+	tga_mapping *mapping = (tga_mapping *) tga;
+	if (mapping->base != NULL)
+		munmap(mapping->base, mapping->length);
+	else
+		free(mapping->tga.data);
+	free(mapping);
+}
+
+#else
+
+/*
+	No mmap here, so we fall back on reading the file.
+*/
+extern tga_read_result tga_map(char const *filename, uint64_t maxpixels)
+{
+	FILE *f = fopen(filename, "rb");
+	if (!f)
+		RETURN_ERROR("Could not open file.", TGA_ERROR_READ_IO);
+
+	tga_read_result result = tga_read(f, TGA_BYTES_MAX, maxpixels);
+	fclose(f);
 	return result;
+}
 
-streamerror:
-	if (nbytes >= maxbytes)
+extern void tga_unmap(tga_data *tga)
+{
+	tga_free(tga);
+}
+
+#endif
+
+#undef RETURN_ERROR
+
+/*
+	CONVERSIONS.
+
+	The kernels work on runs of n pixels. With SSSE3 they move 16 pixels
+	at a time with byte shuffles. 24 bit pixels straddle the 16 byte 
+	vectors, so 48 bytes are loaded and split into four vectors of four
+	pixels each, and the results put back together with byte shifts. 
+	Everything is loaded before anything is stored, which makes working 
+	in place safe.
+*/
+
+#ifdef __SSSE3__
+/*
+	Splits 16 24 bit pixels into four vectors of four, in the low 12 
+	bytes of each.
+*/
+static void split_24(uint8_t const *src, __m128i q[4])
+{
+	__m128i a = _mm_loadu_si128((__m128i const *) src);
+	__m128i b = _mm_loadu_si128((__m128i const *) (src + 16));
+	__m128i c = _mm_loadu_si128((__m128i const *) (src + 32));
+	q[0] = a;
+	q[1] = _mm_alignr_epi8(b, a, 12);
+	q[2] = _mm_alignr_epi8(c, b, 8);
+	q[3] = _mm_srli_si128(c, 4);
+}
+
+/*
+	The opposite of split_24, the top four bytes of each vector must be
+	zero.
+*/
+static void join_24(__m128i const q[4], uint8_t *dst)
+{
+	_mm_storeu_si128((__m128i *) dst, _mm_or_si128(q[0], _mm_slli_si128(q[1], 12)));
+	_mm_storeu_si128((__m128i *) (dst + 16), _mm_or_si128(_mm_srli_si128(q[1], 4), _mm_slli_si128(q[2], 8)));
+	_mm_storeu_si128((__m128i *) (dst + 32), _mm_or_si128(_mm_srli_si128(q[2], 8), _mm_slli_si128(q[3], 4)));
+}
+#endif
+
+static void swap_rb_24(uint8_t *dst, uint8_t const *src, uint64_t n)
+{
+	uint64_t i = 0;
+#ifdef __SSSE3__
+	__m128i const swap = _mm_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, -1, -1, -1, -1);
+	for (; i + 16 <= n; i += 16)
 	{
-		RETURN_ERROR("Image data was larger than permitted.", TGA_ERROR_READ_TOO_FAR);
+		__m128i q[4];
+		split_24(src + i * 3, q);
+		for (int k = 0; k < 4; ++k)
+			q[k] = _mm_shuffle_epi8(q[k], swap);
+		join_24(q, dst + i * 3);
+	}
+#endif
+	for (; i < n; ++i)
+	{
+		uint8_t t = src[i * 3];
+		dst[i * 3 + 1] = src[i * 3 + 1];
+		dst[i * 3] = src[i * 3 + 2];
+		dst[i * 3 + 2] = t;
+	}
+}
+
+static void swap_rb_32(uint8_t *dst, uint8_t const *src, uint64_t n)
+{
+	uint64_t i = 0;
+#ifdef __SSSE3__
+	__m128i const swap = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+	for (; i + 4 <= n; i += 4)
+	{
+		__m128i v = _mm_loadu_si128((__m128i const *) (src + i * 4));
+		_mm_storeu_si128((__m128i *) (dst + i * 4), _mm_shuffle_epi8(v, swap));
 	}
+#endif
+	for (; i < n; ++i)
+	{
+		uint8_t t = src[i * 4];
+		dst[i * 4 + 1] = src[i * 4 + 1];
+		dst[i * 4 + 3] = src[i * 4 + 3];
+		dst[i * 4] = src[i * 4 + 2];
+		dst[i * 4 + 2] = t;
+	}
+}
 
-	RETURN_ERROR("Stream error or unexpected EOF.", TGA_ERROR_READ_EOF);
+static void add_alpha(uint8_t *dst, uint8_t const *src, uint64_t n, uint8_t alpha)
+{
+	uint64_t i = 0;
+#ifdef __SSSE3__
+	__m128i const spread = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+	__m128i const a = _mm_set1_epi32((int) ((uint32_t) alpha << 24));
+	for (; i + 16 <= n; i += 16)
+	{
+		__m128i q[4];
+		split_24(src + i * 3, q);
+		for (int k = 0; k < 4; ++k)
+			_mm_storeu_si128((__m128i *) (dst + i * 4 + k * 16), _mm_or_si128(_mm_shuffle_epi8(q[k], spread), a));
+	}
+#endif
+	for (; i < n; ++i)
+	{
+		dst[i * 4] = src[i * 3];
+		dst[i * 4 + 1] = src[i * 3 + 1];
+		dst[i * 4 + 2] = src[i * 3 + 2];
+		dst[i * 4 + 3] = alpha;
+	}
 }
 
-#undef RETURN_ERROR
-#undef TRY_READ_BYTE
+static void drop_alpha(uint8_t *dst, uint8_t const *src, uint64_t n)
+{
+	uint64_t i = 0;
+#ifdef __SSSE3__
+	__m128i const pack = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+	for (; i + 16 <= n; i += 16)
+	{
+		__m128i q[4];
+		for (int k = 0; k < 4; ++k)
+			q[k] = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *) (src + i * 4 + k * 16)), pack);
+		join_24(q, dst + i * 3);
+	}
+#endif
+	for (; i < n; ++i)
+	{
+		dst[i * 3] = src[i * 4];
+		dst[i * 3 + 1] = src[i * 4 + 1];
+		dst[i * 3 + 2] = src[i * 4 + 2];
+	}
+}
+
+/*
+	c * a / 255, rounded, for c and a up to 255.
+*/
+#define TGA_MUL_255(c, a)	((((c) * (a) + 128) + (((c) * (a) + 128) >> 8)) >> 8)
+
+static void premultiply(uint8_t *dst, uint8_t const *src, uint64_t n)
+{
+	uint64_t i = 0;
+#ifdef __SSSE3__
+	__m128i const swap = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+	/* Spreads the alpha of each 16 bit pixel over its colour channels, the alpha channel gets 255. */
+	__m128i const spread = _mm_setr_epi8(6, 7, 6, 7, 6, 7, -1, -1, 14, 15, 14, 15, 14, 15, -1, -1);
+	__m128i const opaque = _mm_setr_epi16(0, 0, 0, 255, 0, 0, 0, 255);
+	__m128i const round = _mm_set1_epi16(128);
+	__m128i const zero = _mm_setzero_si128();
+	for (; i + 4 <= n; i += 4)
+	{
+		__m128i v = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *) (src + i * 4)), swap);
+		__m128i lo = _mm_unpacklo_epi8(v, zero);
+		__m128i hi = _mm_unpackhi_epi8(v, zero);
+		__m128i alo = _mm_or_si128(_mm_shuffle_epi8(lo, spread), opaque);
+		__m128i ahi = _mm_or_si128(_mm_shuffle_epi8(hi, spread), opaque);
+		lo = _mm_add_epi16(_mm_mullo_epi16(lo, alo), round);
+		hi = _mm_add_epi16(_mm_mullo_epi16(hi, ahi), round);
+		lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+		hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+		_mm_storeu_si128((__m128i *) (dst + i * 4), _mm_packus_epi16(lo, hi));
+	}
+#endif
+	for (; i < n; ++i)
+	{
+		uint32_t b = src[i * 4], g = src[i * 4 + 1], r = src[i * 4 + 2], a = src[i * 4 + 3];
+		dst[i * 4] = (uint8_t) TGA_MUL_255(r, a);
+		dst[i * 4 + 1] = (uint8_t) TGA_MUL_255(g, a);
+		dst[i * 4 + 2] = (uint8_t) TGA_MUL_255(b, a);
+		dst[i * 4 + 3] = (uint8_t) a;
+	}
+}
+
+#undef TGA_MUL_255
+
+static int same_size(tga_data const *dst, tga_data const *src)
+{
+	return dst && src && dst->data && src->data 
+		&& dst->width == src->width && dst->height == src->height;
+}
+
+/*
+	Runs kernel on every scanline of src and the one at the same height
+	in dst. They are visited in the order src stores them, so when 
+	converting in place every scanline is read before the next one is 
+	written.
+*/
+static void convert_rows(tga_data *dst, tga_data const *src, 
+	void (*kernel)(uint8_t *, uint8_t const *, uint64_t))
+{
+	uint64_t const pitch = tga_calc_stride(src);
+	for (uint32_t i = 0; i < src->height; ++i)
+	{
+		uint32_t y = src->stride > 0? i : src->height - 1 - i;
+		kernel(tga_row(dst, y), src->data + i * pitch, src->width);
+	}
+}
+
+extern int tga_swap_rb(tga_data *dst, tga_data const *src)
+{
+	if (!same_size(dst, src) || dst->bitdepth != src->bitdepth)
+		return -1;
+
+	if (src->bitdepth == TGA_24BPP)
+		convert_rows(dst, src, swap_rb_24);
+	else if (src->bitdepth == TGA_32BPP)
+		convert_rows(dst, src, swap_rb_32);
+	else
+		return -1;
+	return 0;
+}
+
+extern int tga_add_alpha(tga_data *dst, tga_data const *src, uint8_t alpha)
+{
+	if (!same_size(dst, src) || src->bitdepth != TGA_24BPP || dst->bitdepth != TGA_32BPP)
+		return -1;
+
+	for (uint16_t y = 0; y < src->height; ++y)
+		add_alpha(tga_row(dst, y), tga_row(src, y), src->width, alpha);
+	return 0;
+}
+
+extern int tga_drop_alpha(tga_data *dst, tga_data const *src)
+{
+	if (dst == src && src->bitdepth == TGA_32BPP && src->data)
+	{
+		/* Pixels move towards the start of their scanline, which stays put. */
+		uint64_t const pitch = tga_calc_stride(src);
+		for (uint32_t i = 0; i < src->height; ++i)
+			drop_alpha(dst->data + i * pitch, src->data + i * pitch, src->width);
+		dst->bitdepth = TGA_24BPP;
+		return 0;
+	}
+	if (!same_size(dst, src) || src->bitdepth != TGA_32BPP || dst->bitdepth != TGA_24BPP)
+		return -1;
+
+	convert_rows(dst, src, drop_alpha);
+	return 0;
+}
+
+extern int tga_premultiply(tga_data *dst, tga_data const *src)
+{
+	if (!same_size(dst, src) || src->bitdepth != TGA_32BPP || dst->bitdepth != TGA_32BPP)
+		return -1;
+
+	convert_rows(dst, src, premultiply);
+	return 0;
+}
+
+extern uint8_t *tga_row(tga_data const *tga, uint16_t y)
+{
+	if (tga->stride > 0)
+		return tga->data + (uint64_t) y * tga->stride;
+	return tga->data + (uint64_t) (tga->height - 1 - y) * -tga->stride;
+}
 
-extern uint64_t tga_calc_stride(tga_data *tga)
+extern uint64_t tga_calc_stride(tga_data const *tga)
 {
-	uint64_t bytes_per_pixel = tga->bitdepth / 8;
-	return tga->width * bytes_per_pixel;
+	return tga->stride < 0? (uint64_t) -tga->stride : (uint64_t) tga->stride;
 }
\ No newline at end of file
@@ -33,8 +33,8 @@
 	probably readable but it will not use the data stored in the footer and
 	extension areas. 
 
-	Currently the library only supports 24-bit and 32-bit uncompressed 
-	non-colormapped TGAs.
+	Currently the library only supports 24-bit and 32-bit non-colormapped
+	TGAs, uncompressed or run length encoded.
 
 	Made by Simon Otter 2012-2014.
 */
@@ -59,7 +59,7 @@
 */
 #define TGA_ERROR_READ_INVALID_DIMENSIONS	3
 /* 
-	Compression not supported at the moment. 
+	Compression other than run length encoding not supported.
 */
 #define TGA_ERROR_READ_COMPRESSED			4
 /* 
@@ -79,6 +79,14 @@
 */
 #define TGA_ERROR_READ_OOM 					8
 #define TGA_ERROR_READ_TOO_FAR				9
+/*
+	The file could not be opened or mapped.
+*/
+#define TGA_ERROR_READ_IO					10
+/*
+	Run length encoded data doesn't fit the image.
+*/
+#define TGA_ERROR_READ_MALFORMED_DATA		11
 
 #define TGA_READ_IS_SUCCESS(res)			((res).error == TGA_READ_SUCCESS)
 
@@ -182,10 +190,18 @@ typedef struct tga_version1_header_s
 			0 lower left hand corner is origin.
 			1 upper left hand corner is origin.
 
-			Is generally 0. Acts as a vertical flip.
+			Is generally 0. Acts as a vertical flip, the reader
+			gives it to tga_data as the sign of the stride.
 
 		Bit 7-6 data storage interleaving flag.
 
+			00 non-interleaved.
+			01 two-way (even/odd) interleaving.
+			10 four-way interleaving.
+			11 reserved.
+
+			Interleaved scanlines are put in order when read.
+
 	*/
 	uint8_t  image_descriptor_byte;
 
@@ -204,14 +220,28 @@ typedef struct tga_data_s
 	uint16_t width;
 	uint16_t height;
 	/* 
-		The image data is arranged from top left to bottom right,
-		BGRA (32 bit) or BGR (24 bit).
-
-		Thus data[0] is the blue byte of the topmost left corner.
+		The memory block holding the scanlines, in the order they are
+		stored in the file. Pixels are BGRA (32 bit) or BGR (24 bit), 
+		left to right.
+
+		Thus data[0] is the blue byte of the left corner of the first 
+		scanline stored, which is the top one if stride is positive and
+		the bottom one if it is negative. Use tga_row to get at a 
+		scanline by its height on screen.
 	*/
 	uint8_t  *data;
 	/* 24 or 32 (32 is with alpha mask.) */
 	uint8_t  bitdepth;
+	/*
+		Bytes from a scanline to the one below it on screen. Negative 
+		for images stored bottom up, which TGA files generally are. 
+		Negating it flips the image without touching the pixels.
+
+		It may be more than width * bitdepth / 8, the scanlines are
+		then padded. Images from tga_create are, mapped images have
+		the packed scanlines of the file.
+	*/
+	int64_t  stride;
 } tga_data;
 
 typedef struct tga_read_result_s
@@ -234,9 +264,50 @@ typedef struct tga_read_result_s
 	uint16_t error;
 } tga_read_result;
 
+/*
+	A TGA being read or written a few scanlines at a time, so pipelines 
+	can work on bands of an image as they arrive without holding all of
+	it in memory.
+
+	Fill it in with tga_read_open or tga_write_open. The fields are 
+	read only, width, height and bitdepth describe the image.
+*/
+typedef struct tga_stream_s
+{
+	FILE *f;
+	uint16_t width;
+	uint16_t height;
+	uint8_t  bitdepth;
+	uint8_t  image_type;
+	/* 
+		The image descriptor byte. Scanlines are read and written in the
+		order they are stored, which is top down if the 
+		TGA_IMAGE_DESCRIPTOR_SCREEN_ORIGIN_BIT_MASK bit is set, and may
+		be interleaved if any of the TGA_IMAGE_DESCRIPTOR_INTERLEAVING_FLAG
+		bits are.
+	*/
+	uint8_t  descriptor;
+	/* Number of scanlines read or written so far. */
+	uint32_t row;
+	/* Bytes read or written so far, and the limit for reading. */
+	uint64_t nbytes;
+	uint64_t maxbytes;
+	/* 
+		Run length decoding state. Packets may cross scanlines, what is
+		left of the current one is kept here.
+	*/
+	uint32_t packet_left;
+	uint8_t  packet_run;
+	uint8_t  packet_pixel[4];
+	/* Run length encoding buffer for a scanline. */
+	uint8_t  *line;
+} tga_stream;
+
 /*
 	Calculates the expected byte length of a piece of image data for a 
-	TGA image. This is the size of the memory block in tga_data->data.
+	TGA image. This is the size of the pixel data in a file, with the 
+	scanlines packed. The memory block of a tga_data may be larger, see
+	tga_create.
 
 	It does not include headers and such.
 
@@ -251,6 +322,12 @@ extern uint64_t tga_len(uint16_t w, uint16_t h, uint8_t bitdepth);
 /*
 	Creates a new TGA image in memory.
 
+	The image is stored top down, with a positive stride. Scanlines 
+	start on 64 byte boundaries, padded up to the next one, and the 
+	block has 64 bytes to spare after the last scanline. So vector
+	loads of up to 64 bytes from any pixel stay inside the block. The 
+	padding is never written out.
+
 	Returns 0 if w or h is zero, or bitdepth is not TGA_24BPP nor TGA_32BPP.
 	Furthermore, on out of memory conditions, also returns a zero
 	pointer.
@@ -271,6 +348,30 @@ extern void tga_free(tga_data *tga);
 */
 extern void tga_write(tga_data *data, FILE *f);
 
+/*
+	Same as tga_write, but writes a run length encoded (type 10) TGA. 
+	Much smaller for images with large flat areas, such as renders on a
+	plain background.
+
+	If data equals 0, does nothing.
+*/
+extern void tga_write_rle(tga_data *data, FILE *f);
+
+/*
+	Writes out a properly formatted TGA datastream to the file 
+	descriptor fd, without going through stdio. Meant for pipelines, 
+	where it saves copying every frame into a stream buffer.
+
+	If the library is compiled with TGA_USE_VMSPLICE (Linux only) and fd
+	is a pipe, the image pages are spliced into the pipe instead of 
+	copied; the header is always copied. The image data must then not be
+	modified or freed until the reader has consumed it.
+
+	Returns 0 on success and -1 on write errors, with errno set. If data
+	equals 0, does nothing. Not available on Windows.
+*/
+extern int tga_write_fd(tga_data *data, int fd);
+
 /*
 	Tries to read an image from file handle f.
 
@@ -308,19 +409,150 @@ extern void tga_write(tga_data *data, FILE *f);
 */
 extern tga_read_result tga_read(FILE *f, uint64_t maxbytes, uint64_t maxpixels);
 
+/*
+	Reads the header of a TGA from f and prepares s for reading its 
+	scanlines with tga_read_rows. maxbytes and maxpixels work as for 
+	tga_read, maxbytes covering everything read through s.
+
+	On success the returned result has a NULL data pointer and
+	s->width, s->height and s->bitdepth describe the image.
+*/
+extern tga_read_result tga_read_open(tga_stream *s, FILE *f, uint64_t maxbytes, uint64_t maxpixels);
+
+/*
+	Reads the next n scanlines into rows, which must hold 
+	n * s->width * s->bitdepth / 8 bytes. Scanlines come in the order
+	they are stored in the file, see s->descriptor.
+
+	Returns TGA_READ_SUCCESS or one of the TGA_ERROR_READ_ codes, 
+	TGA_ERROR_READ_TOO_FAR also if there are fewer than n scanlines 
+	left.
+*/
+extern uint16_t tga_read_rows(tga_stream *s, uint8_t *rows, uint32_t n);
+
+/*
+	Finishes reading through s. The stream f is left open.
+*/
+extern void tga_read_close(tga_stream *s);
+
+/*
+	Writes the header of a w by h TGA to f and prepares s for writing 
+	its scanlines with tga_write_rows. Non-zero top_down marks the image
+	as stored top down, the scanlines are then written from the top, 
+	otherwise from the bottom. Non-zero rle writes a run length encoded
+	TGA.
+
+	Returns 0 on success, -1 on bad arguments, out of memory or write 
+	errors.
+*/
+extern int tga_write_open(tga_stream *s, FILE *f, uint16_t w, uint16_t h, uint8_t bitdepth, int top_down, int rle);
+
+/*
+	Writes the next n scanlines from rows, packed like the data of a 
+	tga_data.
+
+	Returns 0 on success, -1 on write errors or if that would be more 
+	scanlines than the image has.
+*/
+extern int tga_write_rows(tga_stream *s, uint8_t const *rows, uint32_t n);
+
+/*
+	Finishes writing through s and flushes f, which is left open.
+
+	Returns 0 on success, -1 if not all scanlines were written or the
+	flush failed.
+*/
+extern int tga_write_close(tga_stream *s);
+
+/*
+	Maps the TGA file filename into memory and returns an image whose 
+	data points straight into the mapping, without copying it.
+
+	The image data may be modified, the changes are private to the 
+	process and are not written back to the file.
+
+	Fails like tga_read if the header can't be parsed, the file is too
+	short or the image has more than maxpixels pixels. TGA_ERROR_READ_IO 
+	is returned if the file can't be opened or mapped.
+
+	The image must be released with tga_unmap, not tga_free.
+
+	Where mmap isn't available the file is read with tga_read instead.
+*/
+extern tga_read_result tga_map(char const *filename, uint64_t maxpixels);
+
+/*
+	Releases an image returned by tga_map.
+
+	If tga equals 0, does nothing.
+*/
+extern void tga_unmap(tga_data *tga);
+
+/*
+	CONVERSIONS.
+
+	These convert the pixels of src into dst, which must have the same
+	width and height but may be stored the other way round. Unless 
+	stated otherwise, dst may be src to convert in place. Images 
+	converted to RGB order no longer have the order tga_data and 
+	tga_write expect; swapping them again converts them back.
+
+	All return 0 on success and -1 if the images don't fit the 
+	conversion.
+*/
+
+/*
+	BGR to RGB, or BGRA to RGBA, and back. Both images have the same 
+	bitdepth.
+*/
+extern int tga_swap_rb(tga_data *dst, tga_data const *src);
+
+/*
+	24 bit BGR to 32 bit BGRA with a constant alpha. dst must not 
+	overlap src.
+*/
+extern int tga_add_alpha(tga_data *dst, tga_data const *src, uint8_t alpha);
+
+/*
+	32 bit BGRA to 24 bit BGR. When dst is src the image is converted in
+	place and its bitdepth becomes TGA_24BPP, the memory block and the 
+	stride stay as they are.
+*/
+extern int tga_drop_alpha(tga_data *dst, tga_data const *src);
+
+/*
+	32 bit BGRA to 32 bit RGBA with the colour channels multiplied by 
+	alpha.
+*/
+extern int tga_premultiply(tga_data *dst, tga_data const *src);
+
+/*
+	Returns scanline y of tga, counting from the top of the screen 
+	whichever way round the image is stored. The scanline below it 
+	starts tga->stride bytes further on, so loops over an image can do
+
+		uint8_t *row = tga_row(tga, 0);
+		for (uint16_t y = 0; y < tga->height; ++y, row += tga->stride)
+			...
+
+	and work the same on images stored top down and bottom up.
+*/
+extern uint8_t *tga_row(tga_data const *tga, uint16_t y);
+
 /*
 	Calculates the byte stride for a given TGA.
 
 	Stride is the amount of bytes a scanline (row of pixels) 
 	occupies in memory. It is the amount of bytes you need 
-	to move in memory to get the next scanline.
+	to move in memory to get the next scanline in the memory
+	block, the size of tga->stride.
 
-	So after one stride, the row of pixels for y = 1 begins.
+	So after one stride, the row of pixels stored second begins.
 
-	Stride in some formats is larger than the width of the 
-	image, but TGA does not put data after each scanline,
-	so we can safely use the stride directly to get a 
-	pixels position in memory.
+	TGA files don't put data after each scanline, but images
+	in memory may be padded, so the stride can be larger
+	than width * bitdepth / 8. Always use the stride to get
+	a pixels position in memory.
 */
-extern uint64_t tga_calc_stride(tga_data *tga);
+extern uint64_t tga_calc_stride(tga_data const *tga);
 #endif
\ No newline at end of file